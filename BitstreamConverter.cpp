@@ -25,8 +25,25 @@
 #define UINT16_MAX             (65535U)
 #endif
 
+// nal units per packet an in place AnnexB to bitstream rewrite can track
+#define BS_INPLACE_MAX_NALS    256
+
 #include "BitstreamConverter.h"
 
+#include <limits.h>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#if defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
 enum {
     AVC_NAL_SLICE=1,
     AVC_NAL_DPA,
@@ -80,83 +97,363 @@ enum {
 // gsth264parse.c:
 //  * License as published by the Free Software Foundation; either
 //  * version 2.1 of the License, or (at your option) any later version.
+//
+// the reader refills 64 bits at a time into a left aligned cache and only
+// walks the refill window byte by byte when it holds a 0x03 that could be an
+// emulation_prevention_three_byte.
 static void nal_bs_init(nal_bitstream *bs, const uint8_t *data, size_t size)
 {
-  bs->data = data;
-  bs->end  = data + size;
-  bs->head = 0;
-  // fill with something other than 0 to detect
-  //  emulation prevention bytes
-  bs->cache = 0xffffffff;
+  bs->data  = data;
+  bs->end   = data + size;
+  bs->head  = 0;
+  bs->cache = 0;
+  bs->zeros = 0;
+  bs->epb   = true;
+}
+
+// mpeg2 start code payloads have no emulation prevention, read them raw.
+static void nal_bs_init_raw(nal_bitstream *bs, const uint8_t *data, size_t size)
+{
+  nal_bs_init(bs, data, size);
+  bs->epb = false;
+}
+
+static inline void nal_bs_refill(nal_bitstream *bs)
+{
+  int bytes = (64 - bs->head) >> 3;
+
+  if (!bytes)
+    return;
+
+  if (bs->end - bs->data >= 8)
+  {
+    uint64_t word = ((uint64_t)(uint32_t)BS_RB32(bs->data) << 32) | (uint32_t)BS_RB32(bs->data + 4);
+    uint64_t mask = bytes == 8 ? ~0ULL : ~(~0ULL >> (bytes * 8));
+    // any 0x03 byte in the window? may report one in front of a real match,
+    // that only sends us down the slow path.
+    uint64_t x = word ^ 0x0303030303030303ULL;
+    uint64_t has03 = (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
+
+    if (!bs->epb || !(has03 & mask))
+    {
+      uint64_t taken = word >> (64 - bytes * 8);
+
+      bs->cache |= (word & mask) >> bs->head;
+      bs->head  += bytes * 8;
+      bs->data  += bytes;
+      // track the zero bytes at the end of the window, a 0x03 at the start
+      // of the next one is an emulation prevention byte if there are two.
+      if (!taken)
+        bs->zeros += bytes;
+      else
+        bs->zeros = __builtin_ctzll(taken) >> 3;
+      return;
+    }
+  }
+
+  // slow path, near the end of the data or a possible 00 00 03 in the window
+  while (bs->head <= 56 && bs->data < bs->end)
+  {
+    uint8_t a_byte = *bs->data++;
+    if (bs->epb && a_byte == 0x03 && bs->zeros >= 2)
+    {
+      // drop it, the next byte goes to the cache even if it is 0x03
+      bs->zeros = 0;
+      continue;
+    }
+    bs->zeros  = a_byte ? 0 : bs->zeros + 1;
+    bs->cache |= (uint64_t)a_byte << (56 - bs->head);
+    bs->head  += 8;
+  }
 }
 
-static uint32_t nal_bs_read(nal_bitstream *bs, int n)
+static inline uint32_t nal_bs_read(nal_bitstream *bs, int n)
 {
-  uint32_t res = 0;
-  int shift;
+  uint32_t res;
 
   if (n == 0)
+    return 0;
+
+  if (bs->head < n)
+    nal_bs_refill(bs);
+
+  // past the end of the data we read zero bits
+  res = bs->cache >> (64 - n);
+  bs->cache <<= n;
+  bs->head = FFMAX(bs->head - n, 0);
+
+  return res;
+}
+
+// read unsigned Exp-Golomb code
+static int nal_bs_read_ue(nal_bitstream *bs)
+{
+  int i;
+
+  if (bs->head < 32)
+    nal_bs_refill(bs);
+
+  i = bs->cache ? __builtin_clzll(bs->cache) : 64;
+  if (i >= bs->head || i > 31)
+  {
+    // no terminating one bit, truncated or broken stream
+    bs->cache = 0;
+    bs->head  = 0;
+    bs->data  = bs->end;
+    return 0;
+  }
+
+  if (2 * i + 1 <= bs->head)
+  {
+    int n = 2 * i + 1;
+    uint32_t res = (uint32_t)(bs->cache >> (64 - n)) - 1;
+    bs->cache <<= n;
+    bs->head -= n;
     return res;
+  }
+
+  // long code crossing the cache, consume prefix and suffix separately
+  nal_bs_read(bs, i + 1);
+  return (int)((1U << i) - 1 + nal_bs_read(bs, i));
+}
+
+// read signed Exp-Golomb code
+static int nal_bs_read_se(nal_bitstream *bs)
+{
+  int v = nal_bs_read_ue(bs);
+
+  return (v & 1) ? (v + 1) / 2 : -(v / 2);
+}
 
-  // fill up the cache if we need to
-  while (bs->head < n)
+////////////////////////////////////////////////////////////////////////////////////////////
+// parameter set parsing, parsers get the rbsp after the nal header.
+static const uint8_t sps_sar_table[17][2] = {
+  {  0,  1 }, {  1,  1 }, { 12, 11 }, { 10, 11 }, { 16, 11 }, { 40, 33 },
+  { 24, 11 }, { 20, 11 }, { 32, 11 }, { 80, 33 }, { 18, 11 }, { 15, 11 },
+  { 64, 33 }, {160, 99 }, {  4,  3 }, {  3,  2 }, {  2,  1 }
+};
+
+static uint32_t param_set_hash(const uint8_t *data, int size)
+{
+  // FNV-1a, parameter sets are a few dozen bytes
+  uint32_t hash = 2166136261U;
+
+  while (size--)
+    hash = (hash ^ *data++) * 16777619U;
+  return hash;
+}
+
+// aspect_ratio_info up to video_signal_type and chroma_loc_info,
+// the vui starts the same way for h264 and hevc.
+static void sps_parse_vui_head(nal_bitstream *bs, sps_info_struct *sps_info)
+{
+  if (nal_bs_read(bs, 1))                                   // aspect_ratio_info_present_flag
   {
-    uint8_t a_byte;
-    bool check_three_byte;
+    int aspect_ratio_idc = nal_bs_read(bs, 8);
+    if (aspect_ratio_idc == 255)
+    {
+      sps_info->sar_num = nal_bs_read(bs, 16);
+      sps_info->sar_den = nal_bs_read(bs, 16);
+    }
+    else if (aspect_ratio_idc < 17)
+    {
+      sps_info->sar_num = sps_sar_table[aspect_ratio_idc][0];
+      sps_info->sar_den = sps_sar_table[aspect_ratio_idc][1];
+    }
+  }
+  if (nal_bs_read(bs, 1))                                   // overscan_info_present_flag
+    nal_bs_read(bs, 1);                                     // overscan_appropriate_flag
+  if (nal_bs_read(bs, 1))                                   // video_signal_type_present_flag
+  {
+    nal_bs_read(bs, 4);                                     // video_format, video_full_range_flag
+    if (nal_bs_read(bs, 1))                                 // colour_description_present_flag
+      nal_bs_read(bs, 24);
+  }
+  if (nal_bs_read(bs, 1))                                   // chroma_loc_info_present_flag
+  {
+    nal_bs_read_ue(bs);
+    nal_bs_read_ue(bs);
+  }
+}
+
+static bool h264_skip_hrd(nal_bitstream *bs)
+{
+  int cpb_cnt_minus1 = nal_bs_read_ue(bs);
+  if (cpb_cnt_minus1 > 31)
+    return false;
+  nal_bs_read(bs, 8);                                       // bit_rate_scale, cpb_size_scale
+  for (int i = 0; i <= cpb_cnt_minus1; i++)
+  {
+    nal_bs_read_ue(bs);                                     // bit_rate_value_minus1
+    nal_bs_read_ue(bs);                                     // cpb_size_value_minus1
+    nal_bs_read(bs, 1);                                     // cbr_flag
+  }
+  nal_bs_read(bs, 20);                                      // delay and time offset lengths
+  return true;
+}
 
-    check_three_byte = true;
-next_byte:
-    if (bs->data >= bs->end)
+static void h264_skip_scaling_list(nal_bitstream *bs, int size)
+{
+  int last_scale = 8, next_scale = 8;
+
+  for (int j = 0; j < size; j++)
+  {
+    if (next_scale)
+      next_scale = (last_scale + nal_bs_read_se(bs) + 256) % 256;
+    last_scale = next_scale ? next_scale : last_scale;
+  }
+}
+
+static void hevc_skip_profile_tier_level(nal_bitstream *bs, int max_sub_layers_minus1,
+  int *profile_idc, int *level_idc)
+{
+  *profile_idc = nal_bs_read(bs, 8) & 0x1f;                 // profile_space, tier_flag, profile_idc
+  nal_bs_read(bs, 32);                                      // profile_compatibility_flags
+  nal_bs_read(bs, 32);                                      // constraint flags
+  nal_bs_read(bs, 16);
+  *level_idc = nal_bs_read(bs, 8);
+
+  // sub_layer_profile/level_present_flags padded to 8 layers, absent without sub layers
+  int sub_layer_flags = max_sub_layers_minus1 ? nal_bs_read(bs, 16) : 0;
+  for (int i = 0; i < max_sub_layers_minus1; i++)
+  {
+    if (sub_layer_flags & (0x8000 >> (2 * i)))
     {
-      // we're at the end, can't produce more than head number of bits
-      n = bs->head;
-      break;
+      nal_bs_read(bs, 32);                                  // sub_layer profile
+      nal_bs_read(bs, 32);
+      nal_bs_read(bs, 24);
+    }
+    if (sub_layer_flags & (0x4000 >> (2 * i)))
+      nal_bs_read(bs, 8);                                   // sub_layer_level_idc
+  }
+}
+
+static bool hevc_skip_hrd(nal_bitstream *bs, int max_sub_layers_minus1, bool *fixed_frame_rate)
+{
+  bool nal_hrd = nal_bs_read(bs, 1);
+  bool vcl_hrd = nal_bs_read(bs, 1);
+  bool sub_pic_hrd = false;
+
+  if (nal_hrd || vcl_hrd)
+  {
+    sub_pic_hrd = nal_bs_read(bs, 1);
+    if (sub_pic_hrd)
+      nal_bs_read(bs, 19);                                  // tick_divisor and sub pic delays
+    nal_bs_read(bs, 8);                                     // bit_rate_scale, cpb_size_scale
+    if (sub_pic_hrd)
+      nal_bs_read(bs, 4);                                   // cpb_size_du_scale
+    nal_bs_read(bs, 15);                                    // delay and time offset lengths
+  }
+
+  for (int i = 0; i <= max_sub_layers_minus1; i++)
+  {
+    bool fixed_pic_rate = nal_bs_read(bs, 1);               // fixed_pic_rate_general_flag
+    bool low_delay = false;
+    int  cpb_cnt_minus1 = 0;
+
+    if (!fixed_pic_rate)
+      fixed_pic_rate = nal_bs_read(bs, 1);                  // fixed_pic_rate_within_cvs_flag
+    if (fixed_pic_rate)
+      nal_bs_read_ue(bs);                                   // elemental_duration_in_tc_minus1
+    else
+      low_delay = nal_bs_read(bs, 1);
+    if (!low_delay)
+    {
+      cpb_cnt_minus1 = nal_bs_read_ue(bs);
+      if (cpb_cnt_minus1 > 31)
+        return false;
     }
-    // get the byte, this can be an emulation_prevention_three_byte that we need
-    // to ignore.
-    a_byte = *bs->data++;
-    if (check_three_byte && a_byte == 0x03 && ((bs->cache & 0xffff) == 0))
+    *fixed_frame_rate = fixed_pic_rate;
+
+    for (int hrd = 0; hrd < (int)nal_hrd + (int)vcl_hrd; hrd++)
     {
-      // next byte goes unconditionally to the cache, even if it's 0x03
-      check_three_byte = false;
-      goto next_byte;
+      for (int k = 0; k <= cpb_cnt_minus1; k++)
+      {
+        nal_bs_read_ue(bs);                                 // bit_rate_value_minus1
+        nal_bs_read_ue(bs);                                 // cpb_size_value_minus1
+        if (sub_pic_hrd)
+        {
+          nal_bs_read_ue(bs);
+          nal_bs_read_ue(bs);
+        }
+        nal_bs_read(bs, 1);                                 // cbr_flag
+      }
     }
-    // shift bytes in cache, moving the head bits of the cache left
-    bs->cache = (bs->cache << 8) | a_byte;
-    bs->head += 8;
   }
+  return true;
+}
 
-  // bring the required bits down and truncate
-  if ((shift = bs->head - n) > 0)
-    res = bs->cache >> shift;
-  else
-    res = bs->cache;
+static int h264_sps_id(const uint8_t *data, int size)
+{
+  nal_bitstream bs;
 
-  // mask out required bits
-  if (n < 32)
-    res &= (1 << n) - 1;
-  bs->head = shift;
+  nal_bs_init(&bs, data, size);
+  nal_bs_read(&bs, 24);                                     // profile_idc, constraint flags, level_idc
+  return nal_bs_read_ue(&bs);
+}
 
-  return res;
+static int hevc_sps_id(const uint8_t *data, int size)
+{
+  nal_bitstream bs;
+  int profile_idc, level_idc;
+
+  nal_bs_init(&bs, data, size);
+  nal_bs_read(&bs, 4);                                      // sps_video_parameter_set_id
+  int max_sub_layers_minus1 = nal_bs_read(&bs, 3);
+  nal_bs_read(&bs, 1);                                      // sps_temporal_id_nesting_flag
+  hevc_skip_profile_tier_level(&bs, max_sub_layers_minus1, &profile_idc, &level_idc);
+  return nal_bs_read_ue(&bs);
 }
 
-static bool nal_bs_eos(nal_bitstream *bs)
+////////////////////////////////////////////////////////////////////////////////////////////
+// byte writer, a NULL buffer only counts the bytes so the same code gives
+// the exact output size in a first pass and writes it in a second one.
+static inline void byte_writer_init(byte_writer_t *s, uint8_t *buffer)
 {
-  return (bs->data >= bs->end) && (bs->head == 0);
+  s->buf     = buffer;
+  s->buf_ptr = buffer;
+  s->size    = 0;
 }
 
-// read unsigned Exp-Golomb code
-static int nal_bs_read_ue(nal_bitstream *bs)
+static inline void byte_writer_write(byte_writer_t *s, const uint8_t *data, int len)
+{
+  if (s->buf_ptr)
+  {
+    memcpy(s->buf_ptr, data, len);
+    s->buf_ptr += len;
+  }
+  s->size += len;
+}
+
+static inline void byte_writer_w8(byte_writer_t *s, uint8_t value)
 {
-  int i = 0;
+  if (s->buf_ptr)
+    *s->buf_ptr++ = value;
+  s->size += 1;
+}
 
-  while (nal_bs_read(bs, 1) == 0 && !nal_bs_eos(bs) && i < 32)
-    i++;
+static inline void byte_writer_wb16(byte_writer_t *s, uint32_t value)
+{
+  if (s->buf_ptr)
+  {
+    s->buf_ptr[0] = value >> 8;
+    s->buf_ptr[1] = value;
+    s->buf_ptr += 2;
+  }
+  s->size += 2;
+}
 
-  return ((1 << i) - 1 + nal_bs_read(bs, i));
+static inline void byte_writer_wb32(byte_writer_t *s, uint32_t value)
+{
+  if (s->buf_ptr)
+  {
+    BS_WB32(s->buf_ptr, value);
+    s->buf_ptr += 4;
+  }
+  s->size += 4;
 }
 
-static const uint8_t* avc_find_startcode_internal(const uint8_t *p, const uint8_t *end)
+static const uint8_t* avc_find_startcode_c(const uint8_t *p, const uint8_t *end)
 {
   const uint8_t *a = p + 4 - ((intptr_t)p & 3);
 
@@ -197,6 +494,161 @@ static const uint8_t* avc_find_startcode_internal(const uint8_t *p, const uint8_
   return end + 3;
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+// x86 kernels, a start code begins at bit i when bytes i and i+1 are zero
+// and byte i+2 is one. the last two lanes of a vector can not be decided
+// from that vector alone, so the scan advances by the vector size minus two.
+__attribute__((target("sse2")))
+static const uint8_t* avc_find_startcode_sse2(const uint8_t *p, const uint8_t *end)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one  = _mm_set1_epi8(1);
+
+  while (p + 3 < end)
+  {
+    __m128i  v = _mm_loadu_si128((const __m128i*)p);
+    uint32_t z = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+    if (!z)
+    {
+      p += 16;
+      continue;
+    }
+    uint32_t o = _mm_movemask_epi8(_mm_cmpeq_epi8(v, one));
+    uint32_t m = z & (z >> 1) & (o >> 2);
+    if (m)
+    {
+      const uint8_t *sc = p + __builtin_ctz(m);
+      return (sc + 3 < end) ? sc : end;
+    }
+    p += 14;
+  }
+
+  return end;
+}
+
+__attribute__((target("avx2")))
+static const uint8_t* avc_find_startcode_avx2(const uint8_t *p, const uint8_t *end)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one  = _mm256_set1_epi8(1);
+
+  while (p + 3 < end)
+  {
+    __m256i  v = _mm256_loadu_si256((const __m256i*)p);
+    uint32_t z = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+    if (!z)
+    {
+      p += 32;
+      continue;
+    }
+    uint32_t o = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, one));
+    uint32_t m = z & (z >> 1) & (o >> 2);
+    if (m)
+    {
+      const uint8_t *sc = p + __builtin_ctz(m);
+      return (sc + 3 < end) ? sc : end;
+    }
+    p += 30;
+  }
+
+  return end;
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+// NEON has no cheap movemask, skip 16 byte blocks without any zero byte
+// and resolve the (rare) blocks holding zeros with a byte compare.
+static const uint8_t* avc_find_startcode_neon(const uint8_t *p, const uint8_t *end)
+{
+  const uint8x16_t zero = vdupq_n_u8(0);
+
+  while (p + 3 < end)
+  {
+    uint8x16_t z = vceqq_u8(vld1q_u8(p), zero);
+    uint8x8_t  t = vorr_u8(vget_low_u8(z), vget_high_u8(z));
+    if (vget_lane_u64(vreinterpret_u64_u8(t), 0))
+    {
+      const uint8_t *block_end = FFMIN(p + 16, end - 3);
+      for (; p < block_end; p++)
+      {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+          return p;
+      }
+    }
+    else
+      p += 16;
+  }
+
+  return end;
+}
+#endif
+
+typedef struct
+{
+  bs_startcode_kernel kernels[4];
+  int                 count;
+} bs_startcode_table;
+
+static bs_startcode_table avc_build_startcode_table()
+{
+  // ordered from slowest to fastest, only kernels this cpu can run
+  bs_startcode_table table;
+  int n = 0;
+  table.kernels[n].name = "scalar";
+  table.kernels[n++].find = avc_find_startcode_c;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#if defined(__arm__)
+  if (getauxval(AT_HWCAP) & HWCAP_NEON)
+#endif
+  {
+    table.kernels[n].name = "neon";
+    table.kernels[n++].find = avc_find_startcode_neon;
+  }
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+  {
+    table.kernels[n].name = "sse2";
+    table.kernels[n++].find = avc_find_startcode_sse2;
+  }
+  if (__builtin_cpu_supports("avx2"))
+  {
+    table.kernels[n].name = "avx2";
+    table.kernels[n++].find = avc_find_startcode_avx2;
+  }
+#endif
+  table.count = n;
+  return table;
+}
+
+static const bs_startcode_kernel* avc_startcode_kernels(int *count)
+{
+  // decoders on several threads may get here first, a function local
+  // static is built exactly once
+  static const bs_startcode_table table = avc_build_startcode_table();
+
+  if (count)
+    *count = table.count;
+  return table.kernels;
+}
+
+static bs_find_startcode_t avc_select_find_startcode()
+{
+  int count;
+  const bs_startcode_kernel *kernels = avc_startcode_kernels(&count);
+
+  CLog::Log(LOGDEBUG, "CBitstreamParser: using %s start code scanner", kernels[count - 1].name);
+  return kernels[count - 1].find;
+}
+
+static inline const uint8_t* avc_find_startcode_internal(const uint8_t *p, const uint8_t *end)
+{
+  // resolved once on first use, see BS_STARTCODE_PADDING for the input contract
+  static const bs_find_startcode_t find_startcode = avc_select_find_startcode();
+  return find_startcode(p, end);
+}
+
 static const uint8_t* avc_find_startcode(const uint8_t *p, const uint8_t *end)
 {
   const uint8_t *out = avc_find_startcode_internal(p, end);
@@ -207,100 +659,609 @@ static const uint8_t* avc_find_startcode(const uint8_t *p, const uint8_t *end)
 
 ////////////////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////
-CBitstreamParser::CBitstreamParser()
+CBitstreamParser::CBitstreamParser()
+{
+}
+
+CBitstreamParser::~CBitstreamParser()
+{
+  Close();
+}
+
+bool CBitstreamParser::Open()
+{
+  return true;
+}
+
+void CBitstreamParser::Close()
+{
+}
+
+const uint8_t* CBitstreamParser::find_start_code(const uint8_t *p,
+  const uint8_t *end, uint32_t *state)
+{
+  assert(p <= end);
+  if (p >= end)
+    return end;
+
+  for (int i = 0; i < 3; i++) {
+    uint32_t tmp = *state << 8;
+    *state = tmp + *(p++);
+    if (tmp == 0x100 || p == end)
+      return p;
+  }
+
+  // a start code ending in the bytes already consumed was caught above,
+  // resume the scan so one ending at p[-1] is still found.
+  p = avc_find_startcode_internal(p - 3, end);
+  if (p < end)
+    p += 4;
+
+  p = FFMIN(p, end) - 4;
+  *state = BS_RB32(p);
+
+  return p + 4;
+}
+
+const uint8_t* CBitstreamParser::FindStartCode(const uint8_t *p, const uint8_t *end)
+{
+  return avc_find_startcode_internal(p, end);
+}
+
+const bs_startcode_kernel* CBitstreamParser::GetStartCodeKernels(int *count)
+{
+  return avc_startcode_kernels(count);
+}
+
+bool CBitstreamParser::FindIdrSlice(const uint8_t *buf, int buf_size)
+{
+  if (!buf)
+    return false;
+
+  bool rtn = false;
+  uint32_t state = -1;
+  const uint8_t *buf_end = buf + buf_size;
+
+  for(;;)
+  {
+    buf = find_start_code(buf, buf_end, &state);
+    if (buf >= buf_end)
+    {
+      //CLog::Log(LOGDEBUG, "FindIdrSlice: buf(%p), buf_end(%p)", buf, buf_end);
+      break;
+    }
+
+    --buf;
+    int src_length = buf_end - buf;
+    switch (state & 0x1f)
+    {
+      default:
+        CLog::Log(LOGDEBUG, "FindIdrSlice: found nal_type(%d)", state & 0x1f);
+        break;
+      case AVC_NAL_SLICE:
+        CLog::Log(LOGDEBUG, "FindIdrSlice: found NAL_SLICE");
+        break;
+      case AVC_NAL_IDR_SLICE:
+        CLog::Log(LOGDEBUG, "FindIdrSlice: found NAL_IDR_SLICE");
+        rtn = true;
+        break;
+      case AVC_NAL_SEI:
+        CLog::Log(LOGDEBUG, "FindIdrSlice: found NAL_SEI");
+        break;
+      case AVC_NAL_SPS:
+        CLog::Log(LOGDEBUG, "FindIdrSlice: found NAL_SPS");
+        break;
+      case AVC_NAL_PPS:
+        CLog::Log(LOGDEBUG, "FindIdrSlice: found NAL_PPS");
+        break;
+    }
+    buf += src_length;
+  }
+
+  return rtn;
+}
+
+bool CBitstreamParser::IsNonReferencePicture(enum AVCodecID codec, const uint8_t *buf, int buf_size, int max_temporal_id)
+{
+  // true when buf (AnnexB or mpeg2 elementary stream) holds pictures and
+  // none of them is used as reference, these can be dropped before the
+  // decoder sees them. false when unsure.
+  if (!buf)
+    return false;
+
+  bool picture_seen = false;
+  uint32_t state = -1;
+  const uint8_t *buf_end = buf + buf_size;
+
+  for(;;)
+  {
+    buf = find_start_code(buf, buf_end, &state);
+    if (buf >= buf_end)
+      break;
+
+    // state holds the byte after the start code, buf points past it
+    switch (codec)
+    {
+      case AV_CODEC_ID_H264:
+      {
+        int nal_type = state & 0x1f;
+        if (nal_type >= AVC_NAL_SLICE && nal_type <= AVC_NAL_IDR_SLICE)
+        {
+          if (state & 0x60)   // nal_ref_idc
+            return false;
+          picture_seen = true;
+        }
+        break;
+      }
+      case AV_CODEC_ID_HEVC:
+      {
+        // sub-layer non-reference pictures (TRAIL_N, TSA_N, ..., RSV_VCL_N14)
+        // have even nal types below 16. pictures of a higher temporal
+        // sub-layer can still reference them, only the highest one is free.
+        int nal_type = (state >> 1) & 0x3f;
+        if (nal_type < HEVC_NAL_VPS)
+        {
+          if (nal_type > 14 || (nal_type & 1))
+            return false;
+          // nuh_temporal_id_plus1 in the second header byte
+          if (buf >= buf_end || max_temporal_id < 0 || (buf[0] & 7) - 1 != max_temporal_id)
+            return false;
+          picture_seen = true;
+        }
+        break;
+      }
+      case AV_CODEC_ID_MPEG1VIDEO:
+      case AV_CODEC_ID_MPEG2VIDEO:
+        // picture_start_code, temporal_reference(10) picture_coding_type(3)
+        if ((state & 0xff) == 0x00)
+        {
+          if (buf + 1 >= buf_end || ((buf[1] >> 3) & 0x7) != 3)
+            return false;
+          picture_seen = true;
+        }
+        break;
+      default:
+        return false;
+    }
+  }
+
+  return picture_seen;
+}
+
+static int bs_random_access_type(enum AVCodecID codec, const uint8_t *nal, const uint8_t *end)
+{
+  // -1 for units that do not decide it (parameter sets, sei, ...),
+  // otherwise the type of the first picture in the packet.
+  switch (codec)
+  {
+    case AV_CODEC_ID_H264:
+    {
+      int nal_type = nal[0] & 0x1f;
+      if (nal_type == AVC_NAL_IDR_SLICE)
+        return BS_RAP_IDR;
+      if (nal_type != AVC_NAL_SLICE)
+        return -1;
+
+      nal_bitstream bs;
+      nal_bs_init(&bs, nal + 1, FFMIN(end - nal - 1, 16));
+      nal_bs_read_ue(&bs);                                  // first_mb_in_slice
+      return (nal_bs_read_ue(&bs) % 5) == 2 ? BS_RAP_I : BS_RAP_NONE;
+    }
+    case AV_CODEC_ID_HEVC:
+    {
+      int nal_type = (nal[0] >> 1) & 0x3f;
+      if (nal_type == HEVC_NAL_IDR_W_RADL || nal_type == HEVC_NAL_IDR_N_LP)
+        return BS_RAP_IDR;
+      if (nal_type >= HEVC_NAL_BLA_W_LP && nal_type <= HEVC_NAL_CRA_NUT)
+        return BS_RAP_CRA;
+      return nal_type < HEVC_NAL_VPS ? BS_RAP_NONE : -1;
+    }
+    case AV_CODEC_ID_MPEG1VIDEO:
+    case AV_CODEC_ID_MPEG2VIDEO:
+      // picture_start_code, temporal_reference(10) picture_coding_type(3)
+      if (nal[0] != 0x00)
+        return -1;
+      if (end - nal < 3)
+        return BS_RAP_NONE;
+      return ((nal[2] >> 3) & 0x7) == 1 ? BS_RAP_I : BS_RAP_NONE;
+    default:
+      return BS_RAP_NONE;
+  }
+}
+
+int CBitstreamParser::GetRandomAccessType(enum AVCodecID codec, const uint8_t *buf, int buf_size, int length_size)
+{
+  // only looks at the units up to the first picture, cheap enough to run
+  // on every packet of a file.
+  if (!buf)
+    return BS_RAP_NONE;
+
+  uint32_t state = -1;
+  const uint8_t *buf_end = buf + buf_size;
+
+  for(;;)
+  {
+    const uint8_t *nal;
+    if (length_size)
+    {
+      uint32_t nal_size = 0;
+      if (buf_end - buf < length_size)
+        break;
+      for (int i = 0; i < length_size; i++)
+        nal_size = (nal_size << 8) | buf[i];
+      nal = buf + length_size;
+      if (!nal_size || nal_size > (uint32_t)(buf_end - nal))
+        break;
+      buf = nal + nal_size;
+    }
+    else
+    {
+      buf = find_start_code(buf, buf_end, &state);
+      if (buf >= buf_end)
+        break;
+      nal = buf - 1;
+    }
+
+    int type = bs_random_access_type(codec, nal, buf_end);
+    if (type >= 0)
+      return type;
+  }
+
+  return BS_RAP_NONE;
+}
+
+bool CBitstreamParser::GetPictureSize(enum AVCodecID codec, const uint8_t *buf, int buf_size, int *width, int *height)
+{
+  // parameter sets come before the pictures they apply to, the scan stops
+  // at the first picture like GetRandomAccessType.
+  if (!buf)
+    return false;
+
+  uint32_t state = -1;
+  const uint8_t *buf_end = buf + buf_size;
+
+  for(;;)
+  {
+    buf = find_start_code(buf, buf_end, &state);
+    if (buf >= buf_end)
+      break;
+    const uint8_t *nal = buf - 1;
+
+    sps_info_struct sps;
+    switch (codec)
+    {
+      case AV_CODEC_ID_H264:
+      {
+        int nal_type = nal[0] & 0x1f;
+        if (nal_type == AVC_NAL_SPS)
+        {
+          const uint8_t *nal_end = FindStartCode(buf, buf_end);
+          if (!CBitstreamConverter::parseh264_sps(nal + 1, nal_end - nal - 1, &sps))
+            return false;
+          break;
+        }
+        if (nal_type == AVC_NAL_SLICE || nal_type == AVC_NAL_IDR_SLICE)
+          return false;
+        continue;
+      }
+      case AV_CODEC_ID_HEVC:
+      {
+        int nal_type = (nal[0] >> 1) & 0x3f;
+        if (nal_type == HEVC_NAL_SPS)
+        {
+          const uint8_t *nal_end = FindStartCode(buf, buf_end);
+          if (buf_end - nal < 2 || !CBitstreamConverter::parsehevc_sps(nal + 2, nal_end - nal - 2, &sps))
+            return false;
+          break;
+        }
+        if (nal_type < HEVC_NAL_VPS)
+          return false;
+        continue;
+      }
+      case AV_CODEC_ID_MPEG1VIDEO:
+      case AV_CODEC_ID_MPEG2VIDEO:
+        // sequence_header_code, horizontal_size(12) vertical_size(12)
+        if (nal[0] == 0xB3 && buf_end - nal >= 4)
+        {
+          *width = (nal[1] << 4) | (nal[2] >> 4);
+          *height = ((nal[2] & 0x0f) << 8) | nal[3];
+          return *width && *height;
+        }
+        if (nal[0] == 0x00)
+          return false;
+        continue;
+      default:
+        return false;
+    }
+
+    *width = sps.width - sps.crop_left - sps.crop_right;
+    *height = sps.height - sps.crop_top - sps.crop_bottom;
+    return *width > 0 && *height > 0;
+  }
+
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////
+CPicOrderParser::CPicOrderParser()
 {
+  memset(m_spsValid, 0, sizeof(m_spsValid));
+  memset(m_pps, 0, sizeof(m_pps));
+  for (int i = 0; i < BS_MAX_PPS_COUNT; i++)
+    m_pps[i].sps_id = -1;
+  m_sequence = 0;
+  m_pocTypeLogged = false;
+  Reset();
 }
 
-CBitstreamParser::~CBitstreamParser()
+void CPicOrderParser::Reset()
 {
-  Close();
+  // the next picture after a seek is an IDR or a recovery point, both
+  // start over. pictures before the first IDR count as sequence 0.
+  m_prevPocMsb = 0;
+  m_prevPocLsb = 0;
+  m_frameCount = 0;
+  m_firstPicture = true;
 }
 
-bool CBitstreamParser::Open()
+void CPicOrderParser::ParseExtraData(enum AVCodecID codec, const uint8_t *buf, int buf_size)
 {
-  return true;
+  bool hevc = codec == AV_CODEC_ID_HEVC;
+  if ((codec != AV_CODEC_ID_H264 && !hevc) || !buf || buf_size < (hevc ? 23 : 7))
+    return;
+
+  if (buf[0] == 0 && buf[1] == 0 && (buf[2] == 1 || (buf[2] == 0 && buf[3] == 1)))
+  {
+    int sequence, poc;
+    Parse(codec, buf, buf_size, &sequence, &poc);
+    return;
+  }
+
+  // avcC: sps count in the low 5 bits of byte 5, then the sps, a pps count
+  // and the pps. hvcC: an array count in byte 22, each array a type byte
+  // and a 16 bit nal count. every nal is behind a 16 bit size.
+  const uint8_t *p = buf + (hevc ? 22 : 5);
+  const uint8_t *end = buf + buf_size;
+  int arrays = hevc ? *(p++) : 2;
+  for (int a = 0; a < arrays && p < end; a++)
+  {
+    int count;
+    if (hevc)
+    {
+      if (end - p < 3)
+        return;
+      count = BS_RB16(p + 1);
+      p += 3;
+    }
+    else
+      count = *(p++) & (a ? 0xff : 0x1f);
+
+    for (int i = 0; i < count; i++)
+    {
+      if (end - p < 2)
+        return;
+      int size = BS_RB16(p);
+      p += 2;
+      if (size < 1 || end - p < size)
+        return;
+      ParseParamSet(codec, p, size);
+      p += size;
+    }
+  }
 }
 
-void CBitstreamParser::Close()
+void CPicOrderParser::ParseParamSet(enum AVCodecID codec, const uint8_t *nal, int size)
 {
+  if (codec == AV_CODEC_ID_HEVC)
+  {
+    int nal_type = (nal[0] >> 1) & 0x3f;
+    if (size > 2 && nal_type == HEVC_NAL_SPS)
+      ParseSPS(codec, nal + 2, size - 2);
+    else if (size > 2 && nal_type == HEVC_NAL_PPS)
+      ParsePPS(codec, nal + 2, size - 2);
+  }
+  else
+  {
+    int nal_type = nal[0] & 0x1f;
+    if (nal_type == AVC_NAL_SPS)
+      ParseSPS(codec, nal + 1, size - 1);
+    else if (nal_type == AVC_NAL_PPS)
+      ParsePPS(codec, nal + 1, size - 1);
+  }
 }
 
-const uint8_t* CBitstreamParser::find_start_code(const uint8_t *p,
-  const uint8_t *end, uint32_t *state)
+bool CPicOrderParser::Parse(enum AVCodecID codec, const uint8_t *buf, int buf_size, int *sequence, int *poc)
 {
-  assert(p <= end);
-  if (p >= end)
-    return end;
+  *sequence = -1;
+  *poc = 0;
+  bool hevc = codec == AV_CODEC_ID_HEVC;
+  if (codec != AV_CODEC_ID_H264 && !hevc)
+    return true;
+  if (!buf)
+    return false;
 
-  for (int i = 0; i < 3; i++) {
-    uint32_t tmp = *state << 8;
-    *state = tmp + *(p++);
-    if (tmp == 0x100 || p == end)
-      return p;
-  }
+  const uint8_t *end = buf + buf_size;
+  const uint8_t *nal_start = avc_find_startcode(buf, end);
+  const uint8_t *nal_end;
 
-  while (p < end) {
-    if      (p[-1] > 1      ) p += 3;
-    else if (p[-2]          ) p += 2;
-    else if (p[-3]|(p[-1]-1)) p++;
-    else {
-      p++;
+  for (;;) {
+    while (nal_start < end && !*(nal_start++));
+    if (nal_start == end)
       break;
+
+    nal_end = avc_find_startcode(nal_start, end);
+    if (hevc)
+    {
+      int nal_type = (nal_start[0] >> 1) & 0x3f;
+      int size = nal_end - nal_start - 2;
+      if (size > 0 && (nal_type <= HEVC_NAL_RASL_R ||
+                       (nal_type >= HEVC_NAL_BLA_W_LP && nal_type <= HEVC_NAL_CRA_NUT)))
+      {
+        // nuh_temporal_id_plus1 in the second header byte
+        if (ParseSliceHEVC(nal_start + 2, size, nal_type, (nal_start[1] & 7) - 1, poc))
+          *sequence = m_sequence;
+        return true;
+      }
+      ParseParamSet(codec, nal_start, nal_end - nal_start);
+      nal_start = nal_end;
+      continue;
+    }
+
+    int nal_type = nal_start[0] & 0x1f;
+    int size = nal_end - nal_start - 1;
+    if (nal_type == AVC_NAL_SPS || nal_type == AVC_NAL_PPS)
+      ParseParamSet(codec, nal_start, nal_end - nal_start);
+    else if (nal_type == AVC_NAL_SLICE || nal_type == AVC_NAL_IDR_SLICE)
+    {
+      // the first slice decides, later ones belong to the same picture or
+      // to its second field
+      bool idr = nal_type == AVC_NAL_IDR_SLICE;
+      if (idr)
+        m_sequence++, Reset();
+      if (ParseSlice(nal_start + 1, size, (nal_start[0] >> 5) & 0x3, idr, poc))
+        *sequence = m_sequence;
+      return true;
     }
+    nal_start = nal_end;
   }
 
-  p = FFMIN(p, end) - 4;
-  *state = BS_RB32(p);
+  return false;
+}
 
-  return p + 4;
+void CPicOrderParser::ParseSPS(enum AVCodecID codec, const uint8_t *rbsp, int size)
+{
+  sps_info_struct sps;
+  bool parsed = codec == AV_CODEC_ID_HEVC ? CBitstreamConverter::parsehevc_sps(rbsp, size, &sps) :
+                                            CBitstreamConverter::parseh264_sps(rbsp, size, &sps);
+  if (parsed && sps.sps_id >= 0 && sps.sps_id < BS_MAX_SPS_COUNT)
+  {
+    m_sps[sps.sps_id] = sps;
+    m_spsValid[sps.sps_id] = true;
+  }
 }
 
-bool CBitstreamParser::FindIdrSlice(const uint8_t *buf, int buf_size)
+void CPicOrderParser::ParsePPS(enum AVCodecID codec, const uint8_t *rbsp, int size)
 {
-  if (!buf)
+  nal_bitstream bs;
+  nal_bs_init(&bs, rbsp, FFMIN(size, 8));
+
+  int pps_id = nal_bs_read_ue(&bs);
+  int sps_id = nal_bs_read_ue(&bs);
+  if (pps_id >= BS_MAX_PPS_COUNT || sps_id >= BS_MAX_SPS_COUNT)
+    return;
+  pps_info &pps = m_pps[pps_id];
+  pps.sps_id = sps_id;
+  if (codec == AV_CODEC_ID_HEVC)
+  {
+    pps.dependent_slice_segments    = nal_bs_read(&bs, 1);
+    pps.output_flag_present         = nal_bs_read(&bs, 1);
+    pps.num_extra_slice_header_bits = nal_bs_read(&bs, 3);
+  }
+}
+
+bool CPicOrderParser::ParseSlice(const uint8_t *rbsp, int size, int nal_ref_idc, bool idr, int *poc)
+{
+  nal_bitstream bs;
+  nal_bs_init(&bs, rbsp, FFMIN(size, 32));
+
+  nal_bs_read_ue(&bs);                                  // first_mb_in_slice
+  nal_bs_read_ue(&bs);                                  // slice_type
+  int pps_id = nal_bs_read_ue(&bs);
+  if (pps_id >= BS_MAX_PPS_COUNT || m_pps[pps_id].sps_id < 0 || !m_spsValid[m_pps[pps_id].sps_id])
     return false;
+  const sps_info_struct &sps = m_sps[m_pps[pps_id].sps_id];
 
-  bool rtn = false;
-  uint32_t state = -1;
-  const uint8_t *buf_end = buf + buf_size;
+  if (sps.separate_colour_plane)
+    nal_bs_read(&bs, 2);                                // colour_plane_id
+  nal_bs_read(&bs, sps.log2_max_frame_num);             // frame_num
+  if (!sps.frame_mbs_only && nal_bs_read(&bs, 1))       // field_pic_flag
+    nal_bs_read(&bs, 1);                                // bottom_field_flag
+  if (idr)
+    nal_bs_read_ue(&bs);                                // idr_pic_id
 
-  for(;;)
+  switch (sps.pic_order_cnt_type)
   {
-    buf = find_start_code(buf, buf_end, &state);
-    if (buf >= buf_end)
+    case 0:
     {
-      //CLog::Log(LOGDEBUG, "FindIdrSlice: buf(%p), buf_end(%p)", buf, buf_end);
-      break;
+      // 8.2.1.1, the msb wraps with the lsb relative to the last reference picture
+      int lsb = nal_bs_read(&bs, sps.log2_max_poc_lsb);
+      int max_lsb = 1 << sps.log2_max_poc_lsb;
+      int msb = m_prevPocMsb;
+      if (lsb < m_prevPocLsb && m_prevPocLsb - lsb >= max_lsb / 2)
+        msb += max_lsb;
+      else if (lsb > m_prevPocLsb && lsb - m_prevPocLsb > max_lsb / 2)
+        msb -= max_lsb;
+      if (nal_ref_idc)
+        m_prevPocMsb = msb, m_prevPocLsb = lsb;
+      *poc = msb + lsb;
+      return true;
     }
+    case 2:
+      // output order is decode order
+      *poc = m_frameCount++;
+      return true;
+    default:
+      if (!m_pocTypeLogged)
+        CLog::Log(LOGDEBUG, "CPicOrderParser::ParseSlice: poc type %d is not tracked, pictures go by pts", sps.pic_order_cnt_type);
+      m_pocTypeLogged = true;
+      return false;
+  }
+}
 
-    --buf;
-    int src_length = buf_end - buf;
-    switch (state & 0x1f)
-    {
-      default:
-        CLog::Log(LOGDEBUG, "FindIdrSlice: found nal_type(%d)", state & 0x1f);
-        break;
-      case AVC_NAL_SLICE:
-        CLog::Log(LOGDEBUG, "FindIdrSlice: found NAL_SLICE");
-        break;
-      case AVC_NAL_IDR_SLICE:
-        CLog::Log(LOGDEBUG, "FindIdrSlice: found NAL_IDR_SLICE");
-        rtn = true;
-        break;
-      case AVC_NAL_SEI:
-        CLog::Log(LOGDEBUG, "FindIdrSlice: found NAL_SEI");
-        break;
-      case AVC_NAL_SPS:
-        CLog::Log(LOGDEBUG, "FindIdrSlice: found NAL_SPS");
-        break;
-      case AVC_NAL_PPS:
-        CLog::Log(LOGDEBUG, "FindIdrSlice: found NAL_PPS");
-        break;
-    }
-    buf += src_length;
+bool CPicOrderParser::ParseSliceHEVC(const uint8_t *rbsp, int size, int nal_type, int temporal_id, int *poc)
+{
+  nal_bitstream bs;
+  nal_bs_init(&bs, rbsp, FFMIN(size, 32));
+
+  bool irap = nal_type >= HEVC_NAL_BLA_W_LP && nal_type <= HEVC_NAL_CRA_NUT;
+  bool idr = nal_type == HEVC_NAL_IDR_W_RADL || nal_type == HEVC_NAL_IDR_N_LP;
+
+  // a packet starting inside a picture can not be placed
+  if (!nal_bs_read(&bs, 1))                             // first_slice_segment_in_pic_flag
+    return false;
+  if (irap)
+    nal_bs_read(&bs, 1);                                // no_output_of_prior_pics_flag
+  int pps_id = nal_bs_read_ue(&bs);
+  if (pps_id >= BS_MAX_PPS_COUNT || m_pps[pps_id].sps_id < 0 || !m_spsValid[m_pps[pps_id].sps_id])
+    return false;
+  const pps_info &pps = m_pps[pps_id];
+  const sps_info_struct &sps = m_sps[pps.sps_id];
+
+  int lsb = 0;
+  if (!idr)
+  {
+    nal_bs_read(&bs, pps.num_extra_slice_header_bits);  // slice_reserved_flag
+    nal_bs_read_ue(&bs);                                // slice_type
+    if (pps.output_flag_present)
+      nal_bs_read(&bs, 1);                              // pic_output_flag
+    if (sps.separate_colour_plane)
+      nal_bs_read(&bs, 2);                              // colour_plane_id
+    lsb = nal_bs_read(&bs, sps.log2_max_poc_lsb);       // slice_pic_order_cnt_lsb
   }
 
-  return rtn;
+  // 8.3.1, IDR, BLA and a CRA after a seek (NoRaslOutputFlag) reset the
+  // msb. else it wraps with the lsb relative to prevTid0Pic.
+  int max_lsb = 1 << sps.log2_max_poc_lsb;
+  int msb = m_prevPocMsb;
+  if (irap && (nal_type != HEVC_NAL_CRA_NUT || m_firstPicture))
+  {
+    m_sequence++;
+    msb = 0;
+  }
+  else if (lsb < m_prevPocLsb && m_prevPocLsb - lsb >= max_lsb / 2)
+    msb += max_lsb;
+  else if (lsb > m_prevPocLsb && lsb - m_prevPocLsb > max_lsb / 2)
+    msb -= max_lsb;
+  m_firstPicture = false;
+
+  // prevTid0Pic: temporal id 0 and neither RADL, RASL nor sub-layer non-reference
+  bool sub_layer_non_ref = nal_type <= 14 && !(nal_type & 1);
+  if (temporal_id == 0 && !sub_layer_non_ref && (nal_type < HEVC_NAL_RADL_N || nal_type > HEVC_NAL_RASL_R))
+    m_prevPocMsb = msb, m_prevPocLsb = lsb;
+
+  *poc = msb + lsb;
+  return true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////
@@ -310,6 +1271,7 @@ CBitstreamConverter::CBitstreamConverter()
   m_convert_bitstream = false;
   m_convertBuffer     = NULL;
   m_convertSize       = 0;
+  m_convertBufferSize = 0;
   m_inputBuffer       = NULL;
   m_inputSize         = 0;
   m_to_annexb         = false;
@@ -317,7 +1279,12 @@ CBitstreamConverter::CBitstreamConverter()
   m_extrasize         = 0;
   m_convert_3byteTo4byteNALSize = false;
   m_convert_bytestream = false;
+  m_zerocopy          = false;
   m_sps_pps_context.sps_pps_data = NULL;
+  m_nal_length_size   = 0;
+  m_param_sets_changed = false;
+  memset(&m_param_sets, 0, sizeof(m_param_sets));
+  m_param_sets.last_sps_id = -1;
 }
 
 CBitstreamConverter::~CBitstreamConverter()
@@ -348,6 +1315,7 @@ bool CBitstreamConverter::Open(enum AVCodecID codec, uint8_t *in_extradata, int
           m_extradata = (uint8_t*)av_malloc(in_extrasize);
           memcpy(m_extradata, in_extradata, in_extrasize);
           m_convert_bitstream = BitstreamConvertInitAVC(m_extradata, m_extrasize);
+          InitParamSets(in_extradata, in_extrasize);
           return true;
         }
         else
@@ -364,22 +1332,21 @@ bool CBitstreamConverter::Open(enum AVCodecID codec, uint8_t *in_extradata, int
             CLog::Log(LOGINFO, "CBitstreamConverter::Open annexb to bitstream init");
             // video content is from x264 or from bytestream h264 (AnnexB format)
             // NAL reformating to bitstream format needed
-            AVIOContext *pb;
-            if (avio_open_dyn_buf(&pb) < 0)
+            byte_writer_t bw;
+            // size the avcC atom data first, then write it straight into our extradata
+            byte_writer_init(&bw, NULL);
+            if (isom_write_avcc(&bw, in_extradata, in_extrasize) < 0)
+              return false;
+            m_extradata = (uint8_t *)av_malloc(bw.size + FF_INPUT_BUFFER_PADDING_SIZE);
+            if (!m_extradata)
               return false;
             m_convert_bytestream = true;
             // create a valid avcC atom data from ffmpeg's extradata
-            isom_write_avcc(pb, in_extradata, in_extrasize);
-            // unhook from ffmpeg's extradata
-            in_extradata = NULL;
-            // extract the avcC atom data into extradata then write it into avcCData for VDADecoder
-            in_extrasize = avio_close_dyn_buf(pb, &in_extradata);
-            // make a copy of extradata contents
-            m_extradata = (uint8_t *)av_malloc(in_extrasize);
-            memcpy(m_extradata, in_extradata, in_extrasize);
-            m_extrasize = in_extrasize;
-            // done with the converted extradata, we MUST free using av_free
-            av_free(in_extradata);
+            byte_writer_init(&bw, m_extradata);
+            isom_write_avcc(&bw, in_extradata, in_extrasize);
+            memset(m_extradata + bw.size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+            m_extrasize = bw.size;
+            InitParamSets(in_extradata, in_extrasize);
             return true;
           }
           else
@@ -401,6 +1368,7 @@ bool CBitstreamConverter::Open(enum AVCodecID codec, uint8_t *in_extradata, int
             m_extradata = (uint8_t *)av_malloc(in_extrasize);
             memcpy(m_extradata, in_extradata, in_extrasize);
             m_extrasize = in_extrasize;
+            InitParamSets(in_extradata, in_extrasize);
             return true;
           }
         }
@@ -408,6 +1376,7 @@ bool CBitstreamConverter::Open(enum AVCodecID codec, uint8_t *in_extradata, int
         m_extradata = (uint8_t*)av_malloc(in_extrasize);
         memcpy(m_extradata, in_extradata, in_extrasize);
         m_extrasize = in_extrasize;
+        InitParamSets(in_extradata, in_extrasize);
         return true;
       }
       return false;
@@ -434,6 +1403,7 @@ bool CBitstreamConverter::Open(enum AVCodecID codec, uint8_t *in_extradata, int
           m_extradata = (uint8_t*)av_malloc(in_extrasize);
           memcpy(m_extradata, in_extradata, in_extrasize);
           m_convert_bitstream = BitstreamConvertInitHEVC(m_extradata, m_extrasize);
+          InitParamSets(in_extradata, in_extrasize);
           return true;
         }
         else
@@ -448,8 +1418,27 @@ bool CBitstreamConverter::Open(enum AVCodecID codec, uint8_t *in_extradata, int
                (in_extradata[0] == 0 && in_extradata[1] == 0 && in_extradata[2] == 1) )
           {
             CLog::Log(LOGINFO, "CBitstreamConverter::Open annexb to bitstream init");
-            // TODO: convert annexb to bitstream format
-            return false;
+            // video content is from bytestream hevc (AnnexB format)
+            // NAL reformating to bitstream format needed
+            byte_writer_t bw;
+            // size the hvcC atom data first, then write it straight into our extradata
+            byte_writer_init(&bw, NULL);
+            if (isom_write_hvcc(&bw, in_extradata, in_extrasize) < 0)
+            {
+              CLog::Log(LOGNOTICE, "CBitstreamConverter::Open invalid hevc parameter sets");
+              return false;
+            }
+            m_extradata = (uint8_t *)av_malloc(bw.size + FF_INPUT_BUFFER_PADDING_SIZE);
+            if (!m_extradata)
+              return false;
+            m_convert_bytestream = true;
+            // create a valid hvcC atom data from ffmpeg's extradata
+            byte_writer_init(&bw, m_extradata);
+            isom_write_hvcc(&bw, in_extradata, in_extrasize);
+            memset(m_extradata + bw.size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+            m_extrasize = bw.size;
+            InitParamSets(in_extradata, in_extrasize);
+            return true;
           }
           else
           {
@@ -472,6 +1461,7 @@ bool CBitstreamConverter::Open(enum AVCodecID codec, uint8_t *in_extradata, int
         m_extradata = (uint8_t*)av_malloc(in_extrasize);
         memcpy(m_extradata, in_extradata, in_extrasize);
         m_extrasize = in_extrasize;
+        InitParamSets(in_extradata, in_extrasize);
         return true;
       }
       return false;
@@ -491,6 +1481,7 @@ void CBitstreamConverter::Close(void)
   if (m_convertBuffer)
     av_free(m_convertBuffer), m_convertBuffer = NULL;
   m_convertSize = 0;
+  m_convertBufferSize = 0;
 
   if (m_extradata)
     av_free(m_extradata), m_extradata = NULL;
@@ -502,24 +1493,28 @@ void CBitstreamConverter::Close(void)
   m_convert_bitstream = false;
   m_convert_bytestream = false;
   m_convert_3byteTo4byteNALSize = false;
+
+  m_nal_length_size = 0;
+  m_param_sets_changed = false;
+  memset(&m_param_sets, 0, sizeof(m_param_sets));
+  m_param_sets.last_sps_id = -1;
 }
 
 bool CBitstreamConverter::Convert(uint8_t *pData, int iSize)
 {
-  if (m_convertBuffer)
-  {  
-    av_free(m_convertBuffer);
-    m_convertBuffer = NULL;
-  }
   m_inputSize = 0;
   m_convertSize = 0;
   m_inputBuffer = NULL;
+  m_param_sets_changed = false;
 
   if (pData)
   {
     if (m_codec == AV_CODEC_ID_H264 ||
         m_codec == AV_CODEC_ID_HEVC)
     {
+      // before any conversion, zero copy rewrites the packet
+      UpdateParamSets(pData, iSize, m_nal_length_size);
+
       if (m_to_annexb)
       {
         int demuxer_bytes = iSize;
@@ -528,20 +1523,26 @@ bool CBitstreamConverter::Convert(uint8_t *pData, int iSize)
         if (m_convert_bitstream)
         {
           // convert demuxer packet from bitstream to bytestream (AnnexB)
-          int bytestream_size = 0;
-          uint8_t *bytestream_buff = NULL;
-
-          BitstreamConvert(demuxer_content, demuxer_bytes, &bytestream_buff, &bytestream_size);
-          if (bytestream_buff && (bytestream_size > 0))
+          // into the reused convert buffer, sized once for the whole packet.
+          bool sps_pps_inject = false;
+          int bytestream_size = BitstreamConvertSize(demuxer_content, demuxer_bytes, &sps_pps_inject);
+          if (m_zerocopy && bytestream_size > 0 && !sps_pps_inject && m_sps_pps_context.length_size == 4)
+          {
+            // 4 byte lengths become 4 byte start codes in the caller's buffer
+            BitstreamConvertInPlace(demuxer_content, demuxer_bytes);
+            m_inputSize = iSize;
+            m_inputBuffer = pData;
+            return true;
+          }
+          if (bytestream_size > 0 && AllocConvertBuffer(bytestream_size) &&
+              BitstreamConvert(demuxer_content, demuxer_bytes, m_convertBuffer, &bytestream_size))
           {
-            m_convertSize   = bytestream_size;
-            m_convertBuffer = bytestream_buff;
+            m_convertSize = bytestream_size;
             return true;
           }
           else
           {
             m_convertSize = 0;
-            m_convertBuffer = NULL;
             CLog::Log(LOGERROR, "CBitstreamConverter::Convert: error converting.");
             return false;
           }
@@ -558,52 +1559,51 @@ bool CBitstreamConverter::Convert(uint8_t *pData, int iSize)
         m_inputSize = iSize;
         m_inputBuffer = pData;
   
-        if (m_convert_bytestream)
+        if (m_convert_bytestream && m_zerocopy && BytestreamConvertInPlace(pData, iSize))
         {
-          if(m_convertBuffer)
-          {
-            av_free(m_convertBuffer);
-            m_convertBuffer = NULL;
-          }
-          m_convertSize = 0;
-
-          // convert demuxer packet from bytestream (AnnexB) to bitstream
-          AVIOContext *pb;
-
-          if(avio_open_dyn_buf(&pb) < 0)
-          {
+          // 4 byte start codes were rewritten to lengths in the caller's buffer
+        }
+        else if (m_convert_bytestream)
+        {
+          // convert demuxer packet from bytestream (AnnexB) to bitstream,
+          // one pass to size it and one to write into the reused buffer
+          byte_writer_t bw;
+          int size = avc_parse_nal_units(NULL, pData, iSize);
+          if (!AllocConvertBuffer(size))
             return false;
-          }
-          m_convertSize = avc_parse_nal_units(pb, pData, iSize);
-          m_convertSize = avio_close_dyn_buf(pb, &m_convertBuffer);
+          byte_writer_init(&bw, m_convertBuffer);
+          m_convertSize = avc_parse_nal_units(&bw, pData, iSize);
         }
         else if (m_convert_3byteTo4byteNALSize)
         {
-          if(m_convertBuffer)
-          {
-            av_free(m_convertBuffer);
-            m_convertBuffer = NULL;
-          }
-          m_convertSize = 0;
-
           // convert demuxer packet from 3 byte NAL sizes to 4 byte
-          AVIOContext *pb;
-          if (avio_open_dyn_buf(&pb) < 0)
-            return false;
-
           uint32_t nal_size;
           uint8_t *end = pData + iSize;
           uint8_t *nal_start = pData;
-          while (nal_start < end)
+          int size = 0;
+          while (nal_start + 3 <= end)
+          {
+            nal_size = BS_RB24(nal_start);
+            if (nal_start + 3 + nal_size > end)
+              break;
+            size += 4 + nal_size;
+            nal_start += 3 + nal_size;
+          }
+          if (!AllocConvertBuffer(size))
+            return false;
+
+          byte_writer_t bw;
+          byte_writer_init(&bw, m_convertBuffer);
+          nal_start = pData;
+          while (bw.size < size)
           {
             nal_size = BS_RB24(nal_start);
-            avio_wb32(pb, nal_size);
+            byte_writer_wb32(&bw, nal_size);
             nal_start += 3;
-            avio_write(pb, nal_start, nal_size);
+            byte_writer_write(&bw, nal_start, nal_size);
             nal_start += nal_size;
           }
-
-          m_convertSize = avio_close_dyn_buf(pb, &m_convertBuffer);
+          m_convertSize = bw.size;
         }
         return true;
       }
@@ -616,7 +1616,7 @@ bool CBitstreamConverter::Convert(uint8_t *pData, int iSize)
 
 uint8_t *CBitstreamConverter::GetConvertBuffer() const
 {
-  if((m_convert_bitstream || m_convert_bytestream || m_convert_3byteTo4byteNALSize) && m_convertBuffer != NULL)
+  if((m_convert_bitstream || m_convert_bytestream || m_convert_3byteTo4byteNALSize) && m_convertSize > 0)
     return m_convertBuffer;
   else
     return m_inputBuffer;
@@ -624,7 +1624,7 @@ uint8_t *CBitstreamConverter::GetConvertBuffer() const
 
 int CBitstreamConverter::GetConvertSize() const
 {
-  if((m_convert_bitstream || m_convert_bytestream || m_convert_3byteTo4byteNALSize) && m_convertBuffer != NULL)
+  if((m_convert_bitstream || m_convert_bytestream || m_convert_3byteTo4byteNALSize) && m_convertSize > 0)
     return m_convertSize;
   else
     return m_inputSize;
@@ -850,12 +1850,112 @@ bool CBitstreamConverter::IsSlice(uint8_t unit_type)
   }
 }
 
-bool CBitstreamConverter::BitstreamConvert(uint8_t* pData, int iSize, uint8_t **poutbuf, int *poutbuf_size)
+bool CBitstreamConverter::AllocConvertBuffer(int size)
+{
+  // the convert buffer only ever grows, steady state packets reuse it
+  // without touching the heap. contents do not need to survive a grow.
+  if (size < 0 || size > INT_MAX - FF_INPUT_BUFFER_PADDING_SIZE)
+    return false;
+  if (size + FF_INPUT_BUFFER_PADDING_SIZE > m_convertBufferSize)
+  {
+    // half again as much headroom, short of it near INT_MAX
+    int64_t grow_size = (int64_t)size + (size >> 1) + FF_INPUT_BUFFER_PADDING_SIZE;
+    int alloc_size = (int)std::min<int64_t>(grow_size, INT_MAX);
+    if (m_convertBuffer)
+      av_free(m_convertBuffer);
+    m_convertBuffer = (uint8_t*)av_malloc(alloc_size);
+    if (!m_convertBuffer)
+    {
+      m_convertBufferSize = 0;
+      return false;
+    }
+    m_convertBufferSize = alloc_size;
+  }
+  memset(m_convertBuffer + size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+  return true;
+}
+
+int CBitstreamConverter::BitstreamConvertSize(const uint8_t *pData, int iSize, bool *sps_pps_inject)
+{
+  // pre-pass over the packet, returns the exact size of the bytestream
+  // that BitstreamConvert will produce or -1 if the packet is malformed.
+  // runs the same sps/pps injection logic on a copy of the state.
+  *sps_pps_inject = false;
+  int i;
+  const uint8_t *buf = pData;
+  const uint8_t *buf_end = buf + iSize;
+  uint8_t  unit_type, nal_sps, nal_pps;
+  uint8_t  first_idr = m_sps_pps_context.first_idr;
+  uint8_t  idr_sps_pps_seen = m_sps_pps_context.idr_sps_pps_seen;
+  int32_t  nal_size;
+  int      out_size = 0;
+
+  switch (m_codec)
+  {
+    case AV_CODEC_ID_H264:
+      nal_sps = AVC_NAL_SPS;
+      nal_pps = AVC_NAL_PPS;
+      break;
+    case AV_CODEC_ID_HEVC:
+      nal_sps = HEVC_NAL_SPS;
+      nal_pps = HEVC_NAL_PPS;
+      break;
+    default:
+      return -1;
+  }
+
+  if (!buf || iSize <= 0)
+    return -1;
+
+  do
+  {
+    if (buf + m_sps_pps_context.length_size > buf_end)
+      return -1;
+
+    for (nal_size = 0, i = 0; i < m_sps_pps_context.length_size; i++)
+      nal_size = (nal_size << 8) | buf[i];
+
+    buf += m_sps_pps_context.length_size;
+    if (buf + nal_size > buf_end || nal_size <= 0)
+      return -1;
+
+    if (m_codec == AV_CODEC_ID_H264)
+      unit_type = *buf & 0x1f;
+    else
+      unit_type = (*buf >> 1) & 0x3f;
+
+    if (first_idr && (unit_type == nal_sps || unit_type == nal_pps))
+      idr_sps_pps_seen = 1;
+
+    out_size += (out_size ? 3 : 4) + nal_size;
+    if (first_idr && IsIDR(unit_type) && !idr_sps_pps_seen)
+    {
+      out_size += m_sps_pps_context.size;
+      *sps_pps_inject = true;
+      first_idr = 0;
+    }
+    else if (!first_idr && IsSlice(unit_type))
+    {
+      first_idr = 1;
+      idr_sps_pps_seen = 0;
+    }
+
+    buf += nal_size;
+  } while (buf < buf_end);
+
+  if (out_size > INT_MAX - FF_INPUT_BUFFER_PADDING_SIZE)
+    return -1;
+
+  return out_size;
+}
+
+bool CBitstreamConverter::BitstreamConvert(uint8_t* pData, int iSize, uint8_t *poutbuf, int *poutbuf_size)
 {
   // based on h264_mp4toannexb_bsf.c (ffmpeg)
   // which is Copyright (c) 2007 Benoit Fouet <benoit.fouet@free.fr>
   // and Licensed GPL 2.1 or greater
 
+  // poutbuf must hold at least BitstreamConvertSize() bytes for this packet.
   int i;
   uint8_t *buf = pData;
   uint32_t buf_size = iSize;
@@ -864,6 +1964,8 @@ bool CBitstreamConverter::BitstreamConvert(uint8_t* pData, int iSize, uint8_t **
   uint32_t cumul_size = 0;
   const uint8_t *buf_end = buf + buf_size;
 
+  *poutbuf_size = 0;
+
   switch (m_codec)
   {
     case AV_CODEC_ID_H264:
@@ -906,13 +2008,13 @@ bool CBitstreamConverter::BitstreamConvert(uint8_t* pData, int iSize, uint8_t **
       // prepend only to the first access unit of an IDR picture, if no sps/pps already present
     if (m_sps_pps_context.first_idr && IsIDR(unit_type) && !m_sps_pps_context.idr_sps_pps_seen)
     {
-      BitstreamAllocAndCopy(poutbuf, poutbuf_size,
+      BitstreamCopy(poutbuf, poutbuf_size,
         m_sps_pps_context.sps_pps_data, m_sps_pps_context.size, buf, nal_size);
       m_sps_pps_context.first_idr = 0;
     }
     else
     {
-      BitstreamAllocAndCopy(poutbuf, poutbuf_size, NULL, 0, buf, nal_size);
+      BitstreamCopy(poutbuf, poutbuf_size, NULL, 0, buf, nal_size);
       if (!m_sps_pps_context.first_idr && IsSlice(unit_type))
       {
           m_sps_pps_context.first_idr = 1;
@@ -920,19 +2022,107 @@ bool CBitstreamConverter::BitstreamConvert(uint8_t* pData, int iSize, uint8_t **
       }
     }
 
-    buf += nal_size;
-    cumul_size += nal_size + m_sps_pps_context.length_size;
-  } while (cumul_size < buf_size);
+    buf += nal_size;
+    cumul_size += nal_size + m_sps_pps_context.length_size;
+  } while (cumul_size < buf_size);
+
+  return true;
+
+fail:
+  *poutbuf_size = 0;
+  return false;
+}
+
+void CBitstreamConverter::BitstreamConvertInPlace(uint8_t *pData, int iSize)
+{
+  // only for packets BitstreamConvertSize accepted with 4 byte lengths and
+  // no sps/pps to inject, every length field is overwritten by 00 00 00 01.
+  // keeps the sps/pps tracking in step with BitstreamConvert.
+  uint8_t *buf = pData;
+  const uint8_t *buf_end = buf + iSize;
+  uint8_t  unit_type, nal_sps, nal_pps;
+  uint32_t nal_size;
+
+  if (m_codec == AV_CODEC_ID_H264)
+  {
+    nal_sps = AVC_NAL_SPS;
+    nal_pps = AVC_NAL_PPS;
+  }
+  else
+  {
+    nal_sps = HEVC_NAL_SPS;
+    nal_pps = HEVC_NAL_PPS;
+  }
+
+  while (buf < buf_end)
+  {
+    nal_size = BS_RB32(buf);
+    BS_WB32(buf, 1);
+    buf += 4;
+
+    if (m_codec == AV_CODEC_ID_H264)
+      unit_type = *buf & 0x1f;
+    else
+      unit_type = (*buf >> 1) & 0x3f;
+
+    if (m_sps_pps_context.first_idr && (unit_type == nal_sps || unit_type == nal_pps))
+      m_sps_pps_context.idr_sps_pps_seen = 1;
+
+    if (!m_sps_pps_context.first_idr && IsSlice(unit_type))
+    {
+      m_sps_pps_context.first_idr = 1;
+      m_sps_pps_context.idr_sps_pps_seen = 0;
+    }
+
+    buf += nal_size;
+  }
+}
+
+bool CBitstreamConverter::BytestreamConvertInPlace(uint8_t *pData, int iSize)
+{
+  // AnnexB to bitstream without a copy, only possible when every nal is
+  // introduced by exactly one 4 byte start code. the layout is checked
+  // before anything is written so a rejected packet is left untouched.
+  const uint8_t *end = pData + iSize;
+  const uint8_t *nal_start, *nal_end;
+  int nal_ends[BS_INPLACE_MAX_NALS];
+  int nal_count = 0;
+
+  if (iSize < 5 || BS_RB32(pData) != 0x00000001)
+    return false;
+
+  nal_start = pData + 4;
+  while (nal_start < end)
+  {
+    if (nal_count == BS_INPLACE_MAX_NALS)
+      return false;
+
+    nal_end = avc_find_startcode(nal_start, end);
+    if (nal_end == nal_start)
+      return false;
+    nal_ends[nal_count++] = nal_end - pData;
+    if (nal_end == end)
+      break;
 
-  return true;
+    if (nal_end + 4 > end || BS_RB32(nal_end) != 0x00000001)
+      return false;
+    nal_start = nal_end + 4;
+  }
+  if (nal_start >= end)
+    return false;
 
-fail:
-  av_free(*poutbuf), *poutbuf = NULL;
-  *poutbuf_size = 0;
-  return false;
+  int nal_offset = 0;
+  for (int i = 0; i < nal_count; i++)
+  {
+    BS_WB32(pData + nal_offset, nal_ends[i] - nal_offset - 4);
+    nal_offset = nal_ends[i];
+  }
+
+  m_convertSize = 0;
+  return true;
 }
 
-void CBitstreamConverter::BitstreamAllocAndCopy( uint8_t **poutbuf, int *poutbuf_size,
+void CBitstreamConverter::BitstreamCopy(uint8_t *poutbuf, int *poutbuf_size,
     const uint8_t *sps_pps, uint32_t sps_pps_size, const uint8_t *in, uint32_t in_size)
 {
   // based on h264_mp4toannexb_bsf.c (ffmpeg)
@@ -941,30 +2131,25 @@ void CBitstreamConverter::BitstreamAllocAndCopy( uint8_t **poutbuf, int *poutbuf
 
   uint32_t offset = *poutbuf_size;
   uint8_t nal_header_size = offset ? 3 : 4;
-  void *tmp;
 
   *poutbuf_size += sps_pps_size + in_size + nal_header_size;
-  tmp = av_realloc(*poutbuf, *poutbuf_size);
-  if (!tmp)
-    return;
-  *poutbuf = (uint8_t*)tmp;
   if (sps_pps)
-    memcpy(*poutbuf + offset, sps_pps, sps_pps_size);
+    memcpy(poutbuf + offset, sps_pps, sps_pps_size);
 
-  memcpy(*poutbuf + sps_pps_size + nal_header_size + offset, in, in_size);
+  memcpy(poutbuf + sps_pps_size + nal_header_size + offset, in, in_size);
   if (!offset)
   {
-    BS_WB32(*poutbuf + sps_pps_size, 1);
+    BS_WB32(poutbuf + sps_pps_size, 1);
   }
   else
   {
-    (*poutbuf + offset + sps_pps_size)[0] = 0;
-    (*poutbuf + offset + sps_pps_size)[1] = 0;
-    (*poutbuf + offset + sps_pps_size)[2] = 1;
+    (poutbuf + offset + sps_pps_size)[0] = 0;
+    (poutbuf + offset + sps_pps_size)[1] = 0;
+    (poutbuf + offset + sps_pps_size)[2] = 1;
   }
 }
 
-const int CBitstreamConverter::avc_parse_nal_units(AVIOContext *pb, const uint8_t *buf_in, int size)
+const int CBitstreamConverter::avc_parse_nal_units(byte_writer_t *bw, const uint8_t *buf_in, int size)
 {
   const uint8_t *p = buf_in;
   const uint8_t *end = p + size;
@@ -979,8 +2164,11 @@ const int CBitstreamConverter::avc_parse_nal_units(AVIOContext *pb, const uint8_
       break;
 
     nal_end = avc_find_startcode(nal_start, end);
-    avio_wb32(pb, nal_end - nal_start);
-    avio_write(pb, nal_start, nal_end - nal_start);
+    if (bw)
+    {
+      byte_writer_wb32(bw, nal_end - nal_start);
+      byte_writer_write(bw, nal_start, nal_end - nal_start);
+    }
     size += 4 + nal_end - nal_start;
     nal_start = nal_end;
   }
@@ -989,19 +2177,22 @@ const int CBitstreamConverter::avc_parse_nal_units(AVIOContext *pb, const uint8_
 
 const int CBitstreamConverter::avc_parse_nal_units_buf(const uint8_t *buf_in, uint8_t **buf, int *size)
 {
-  AVIOContext *pb;
-  int ret = avio_open_dyn_buf(&pb);
-  if (ret < 0)
-    return ret;
-
-  avc_parse_nal_units(pb, buf_in, *size);
+  byte_writer_t bw;
+  int out_size = avc_parse_nal_units(NULL, buf_in, *size);
 
   av_freep(buf);
-  *size = avio_close_dyn_buf(pb, buf);
+  *buf = (uint8_t*)av_malloc(out_size + FF_INPUT_BUFFER_PADDING_SIZE);
+  if (!*buf)
+    return AVERROR(ENOMEM);
+
+  byte_writer_init(&bw, *buf);
+  avc_parse_nal_units(&bw, buf_in, *size);
+  memset(*buf + out_size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+  *size = out_size;
   return 0;
 }
 
-const int CBitstreamConverter::isom_write_avcc(AVIOContext *pb, const uint8_t *data, int len)
+const int CBitstreamConverter::isom_write_avcc(byte_writer_t *bw, const uint8_t *data, int len)
 {
   // extradata from bytestream h264, convert to avcC atom data for bitstream
   if (len > 6)
@@ -1042,28 +2233,152 @@ const int CBitstreamConverter::isom_write_avcc(AVIOContext *pb, const uint8_t *d
       if (!sps || !pps || sps_size < 4 || sps_size > UINT16_MAX || pps_size > UINT16_MAX)
         assert(0);
 
-      avio_w8(pb, 1); /* version */
-      avio_w8(pb, sps[1]); /* profile */
-      avio_w8(pb, sps[2]); /* profile compat */
-      avio_w8(pb, sps[3]); /* level */
-      avio_w8(pb, 0xff); /* 6 bits reserved (111111) + 2 bits nal size length - 1 (11) */
-      avio_w8(pb, 0xe1); /* 3 bits reserved (111) + 5 bits number of sps (00001) */
+      byte_writer_w8(bw, 1); /* version */
+      byte_writer_w8(bw, sps[1]); /* profile */
+      byte_writer_w8(bw, sps[2]); /* profile compat */
+      byte_writer_w8(bw, sps[3]); /* level */
+      byte_writer_w8(bw, 0xff); /* 6 bits reserved (111111) + 2 bits nal size length - 1 (11) */
+      byte_writer_w8(bw, 0xe1); /* 3 bits reserved (111) + 5 bits number of sps (00001) */
 
-      avio_wb16(pb, sps_size);
-      avio_write(pb, sps, sps_size);
+      byte_writer_wb16(bw, sps_size);
+      byte_writer_write(bw, sps, sps_size);
       if (pps)
       {
-        avio_w8(pb, 1); /* number of pps */
-        avio_wb16(pb, pps_size);
-        avio_write(pb, pps, pps_size);
+        byte_writer_w8(bw, 1); /* number of pps */
+        byte_writer_wb16(bw, pps_size);
+        byte_writer_write(bw, pps, pps_size);
       }
       av_free(start);
     }
     else
     {
-      avio_write(pb, data, len);
+      byte_writer_write(bw, data, len);
+    }
+  }
+  return 0;
+}
+
+const int CBitstreamConverter::isom_write_hvcc(byte_writer_t *bw, const uint8_t *data, int len)
+{
+  // extradata from bytestream hevc, convert to hvcC atom data for bitstream.
+  // the configuration fields come from the first SPS, every VPS/SPS/PPS
+  // goes into its own nal unit array.
+  static const uint8_t array_types[3] = { HEVC_NAL_VPS, HEVC_NAL_SPS, HEVC_NAL_PPS };
+  uint8_t *buf = NULL, *end, *ptr;
+  const uint8_t *sps = NULL;
+  uint32_t sps_size = 0;
+  int num_nalus[3] = { 0, 0, 0 };
+
+  if (len < 6 || (BS_RB32(data) != 0x00000001 && BS_RB24(data) != 0x000001))
+    return -1;
+
+  int ret = avc_parse_nal_units_buf(data, &buf, &len);
+  if (ret < 0)
+    return ret;
+  end = buf + len;
+
+  for (ptr = buf; end - ptr > 4; )
+  {
+    uint32_t size = FFMIN(BS_RB32(ptr), end - ptr - 4);
+    uint8_t nal_type = (ptr[4] >> 1) & 0x3f;
+    for (int i = 0; i < 3; i++)
+    {
+      if (nal_type == array_types[i] && size <= UINT16_MAX)
+        num_nalus[i]++;
+    }
+    if (nal_type == HEVC_NAL_SPS && !sps)
+    {
+      sps = ptr + 4;
+      sps_size = size;
+    }
+    ptr += 4 + size;
+  }
+
+  if (!sps || !num_nalus[0] || !num_nalus[2] || sps_size < 16)
+  {
+    av_free(buf);
+    return -1;
+  }
+
+  nal_bitstream bs;
+  nal_bs_init(&bs, sps, sps_size);
+
+  nal_bs_read(&bs, 16);                                     // nal_unit_header
+  nal_bs_read(&bs, 4);                                      // sps_video_parameter_set_id
+  int max_sub_layers_minus1     = nal_bs_read(&bs, 3);
+  int temporal_id_nesting_flag  = nal_bs_read(&bs, 1);
+
+  // profile_tier_level(1, sps_max_sub_layers_minus1)
+  uint8_t  profile_space_tier_idc = nal_bs_read(&bs, 8);
+  uint32_t compatibility_flags    = nal_bs_read(&bs, 32);
+  uint32_t constraint_flags_hi    = nal_bs_read(&bs, 32);
+  uint32_t constraint_flags_lo    = nal_bs_read(&bs, 16);
+  uint8_t  level_idc              = nal_bs_read(&bs, 8);
+
+  // sub_layer_profile/level_present_flags padded to 8 layers, absent without sub layers
+  int sub_layer_flags = max_sub_layers_minus1 ? nal_bs_read(&bs, 16) : 0;
+  for (int i = 0; i < max_sub_layers_minus1; i++)
+  {
+    if (sub_layer_flags & (0x8000 >> (2 * i)))
+    {
+      nal_bs_read(&bs, 32);                                 // sub_layer profile
+      nal_bs_read(&bs, 32);
+      nal_bs_read(&bs, 24);
+    }
+    if (sub_layer_flags & (0x4000 >> (2 * i)))
+      nal_bs_read(&bs, 8);                                  // sub_layer_level_idc
+  }
+  nal_bs_read_ue(&bs);                                      // sps_seq_parameter_set_id
+  int chroma_format_idc = nal_bs_read_ue(&bs);
+  if (chroma_format_idc == 3)
+    nal_bs_read(&bs, 1);                                    // separate_colour_plane_flag
+  nal_bs_read_ue(&bs);                                      // pic_width_in_luma_samples
+  nal_bs_read_ue(&bs);                                      // pic_height_in_luma_samples
+  if (nal_bs_read(&bs, 1))                                  // conformance_window_flag
+  {
+    nal_bs_read_ue(&bs);
+    nal_bs_read_ue(&bs);
+    nal_bs_read_ue(&bs);
+    nal_bs_read_ue(&bs);
+  }
+  int bit_depth_luma_minus8   = nal_bs_read_ue(&bs);
+  int bit_depth_chroma_minus8 = nal_bs_read_ue(&bs);
+
+  byte_writer_w8(bw, 1);                                           /* version */
+  byte_writer_w8(bw, profile_space_tier_idc);
+  byte_writer_wb32(bw, compatibility_flags);
+  byte_writer_wb32(bw, constraint_flags_hi);
+  byte_writer_wb16(bw, constraint_flags_lo);
+  byte_writer_w8(bw, level_idc);
+  byte_writer_wb16(bw, 0xf000);                                    /* 4 bits reserved + min_spatial_segmentation_idc */
+  byte_writer_w8(bw, 0xfc);                                        /* 6 bits reserved + parallelismType */
+  byte_writer_w8(bw, 0xfc | (chroma_format_idc & 0x3));
+  byte_writer_w8(bw, 0xf8 | (bit_depth_luma_minus8 & 0x7));
+  byte_writer_w8(bw, 0xf8 | (bit_depth_chroma_minus8 & 0x7));
+  byte_writer_wb16(bw, 0);                                         /* avgFrameRate */
+  /* constantFrameRate, numTemporalLayers, temporalIdNested, lengthSizeMinusOne (11) */
+  byte_writer_w8(bw, ((max_sub_layers_minus1 + 1) << 3) | (temporal_id_nesting_flag << 2) | 0x3);
+  byte_writer_w8(bw, num_nalus[1] ? 3 : 2);                        /* numOfArrays */
+
+  for (int i = 0; i < 3; i++)
+  {
+    if (!num_nalus[i])
+      continue;
+    byte_writer_w8(bw, 0x80 | array_types[i]);                     /* array_completeness + NAL_unit_type */
+    byte_writer_wb16(bw, num_nalus[i]);
+    for (ptr = buf; end - ptr > 4; )
+    {
+      uint32_t size = FFMIN(BS_RB32(ptr), end - ptr - 4);
+      if (((ptr[4] >> 1) & 0x3f) == array_types[i] && size <= UINT16_MAX)
+      {
+        byte_writer_wb16(bw, size);
+        byte_writer_write(bw, ptr + 4, size);
+      }
+      ptr += 4 + size;
     }
   }
+
+  av_free(buf);
   return 0;
 }
 
@@ -1269,7 +2584,7 @@ bool CBitstreamConverter::mpeg2_sequence_header(const uint8_t *data, const uint3
     if (*nal_start == 0xB3)
     {
       nal_bitstream bs;
-      nal_bs_init(&bs, nal_start, end - nal_start);
+      nal_bs_init_raw(&bs, nal_start, end - nal_start);
 
       // sequence_header_code
       nal_bs_read(&bs, 8);
@@ -1372,84 +2687,560 @@ bool CBitstreamConverter::mpeg2_sequence_header(const uint8_t *data, const uint3
 
 void CBitstreamConverter::parseh264_sps(const uint8_t *sps, const uint32_t sps_size, bool *interlaced, int32_t *max_ref_frames)
 {
-  nal_bitstream bs;
   sps_info_struct sps_info;
 
+  if (!parseh264_sps(sps, sps_size, &sps_info))
+    return;
+
+  *interlaced = sps_info.interlaced;
+  *max_ref_frames = sps_info.max_ref_frames;
+}
+
+bool CBitstreamConverter::parseh264_sps(const uint8_t *sps, const uint32_t sps_size, sps_info_struct *sps_info)
+{
+  nal_bitstream bs;
+  int separate_colour_plane_flag = 0;
+
+  memset(sps_info, 0, sizeof(*sps_info));
+  sps_info->chroma_format_idc = 1;
+  sps_info->bit_depth_luma    = 8;
+  sps_info->bit_depth_chroma  = 8;
+
+  nal_bs_init(&bs, sps, sps_size);
+
+  sps_info->profile_idc = nal_bs_read(&bs, 8);
+  nal_bs_read(&bs, 8);  // constraint_set0..5_flags, reserved
+  sps_info->level_idc   = nal_bs_read(&bs, 8);
+  sps_info->sps_id      = nal_bs_read_ue(&bs);
+  if (sps_info->sps_id >= BS_MAX_SPS_COUNT)
+    return false;
+
+  if (sps_info->profile_idc == 100 ||
+      sps_info->profile_idc == 110 ||
+      sps_info->profile_idc == 122 ||
+      sps_info->profile_idc == 244 ||
+      sps_info->profile_idc == 44  ||
+      sps_info->profile_idc == 83  ||
+      sps_info->profile_idc == 86  ||
+      sps_info->profile_idc == 118 ||
+      sps_info->profile_idc == 128 ||
+      sps_info->profile_idc == 138 ||
+      sps_info->profile_idc == 139 ||
+      sps_info->profile_idc == 134 ||
+      sps_info->profile_idc == 135)
+  {
+    sps_info->chroma_format_idc = nal_bs_read_ue(&bs);
+    if (sps_info->chroma_format_idc > 3)
+      return false;
+    if (sps_info->chroma_format_idc == 3)
+      separate_colour_plane_flag = nal_bs_read(&bs, 1);
+    sps_info->bit_depth_luma    = nal_bs_read_ue(&bs) + 8;
+    sps_info->bit_depth_chroma  = nal_bs_read_ue(&bs) + 8;
+    nal_bs_read(&bs, 1);  // qpprime_y_zero_transform_bypass_flag
+
+    if (nal_bs_read(&bs, 1))  // seq_scaling_matrix_present_flag
+    {
+      for (int i = 0; i < (sps_info->chroma_format_idc != 3 ? 8 : 12); i++)
+      {
+        if (nal_bs_read(&bs, 1))  // seq_scaling_list_present_flag
+          h264_skip_scaling_list(&bs, i < 6 ? 16 : 64);
+      }
+    }
+  }
+
+  // must be between 0 and 12
+  int log2_max_frame_num_minus4 = nal_bs_read_ue(&bs);
+  if (log2_max_frame_num_minus4 > 12)
+    return false;
+  sps_info->log2_max_frame_num = log2_max_frame_num_minus4 + 4;
+  sps_info->separate_colour_plane = separate_colour_plane_flag;
+
+  int pic_order_cnt_type = nal_bs_read_ue(&bs);
+  sps_info->pic_order_cnt_type = pic_order_cnt_type;
+  if (pic_order_cnt_type == 0)
+  {
+    int log2_max_pic_order_cnt_lsb_minus4 = nal_bs_read_ue(&bs);
+    if (log2_max_pic_order_cnt_lsb_minus4 > 12)
+      return false;
+    sps_info->log2_max_poc_lsb = log2_max_pic_order_cnt_lsb_minus4 + 4;
+  }
+  else if (pic_order_cnt_type == 1)
+  {
+    nal_bs_read(&bs, 1);  // delta_pic_order_always_zero_flag
+    nal_bs_read_se(&bs);  // offset_for_non_ref_pic
+    nal_bs_read_se(&bs);  // offset_for_top_to_bottom_field
+    int num_ref_frames_in_pic_order_cnt_cycle = nal_bs_read_ue(&bs);
+    if (num_ref_frames_in_pic_order_cnt_cycle > 255)
+      return false;
+    for (int i = 0; i < num_ref_frames_in_pic_order_cnt_cycle; i++)
+      nal_bs_read_se(&bs);  // offset_for_ref_frame
+  }
+
+  sps_info->max_ref_frames = nal_bs_read_ue(&bs);
+  nal_bs_read(&bs, 1);  // gaps_in_frame_num_value_allowed_flag
+  int pic_width_in_mbs_minus1        = nal_bs_read_ue(&bs);
+  int pic_height_in_map_units_minus1 = nal_bs_read_ue(&bs);
+
+  int frame_mbs_only_flag = nal_bs_read(&bs, 1);
+  if (!frame_mbs_only_flag)
+    nal_bs_read(&bs, 1);  // mb_adaptive_frame_field_flag
+  nal_bs_read(&bs, 1);  // direct_8x8_inference_flag
+
+  sps_info->interlaced = !frame_mbs_only_flag;
+  sps_info->frame_mbs_only = frame_mbs_only_flag;
+  sps_info->width  = (pic_width_in_mbs_minus1 + 1) * 16;
+  sps_info->height = (pic_height_in_map_units_minus1 + 1) * 16 * (2 - frame_mbs_only_flag);
+
+  if (nal_bs_read(&bs, 1))  // frame_cropping_flag
+  {
+    // crop units depend on the chroma subsampling and on field coding
+    int chroma_array_type = separate_colour_plane_flag ? 0 : sps_info->chroma_format_idc;
+    int crop_unit_x = (chroma_array_type == 1 || chroma_array_type == 2) ? 2 : 1;
+    int crop_unit_y = (chroma_array_type == 1 ? 2 : 1) * (2 - frame_mbs_only_flag);
+
+    sps_info->crop_left   = nal_bs_read_ue(&bs) * crop_unit_x;
+    sps_info->crop_right  = nal_bs_read_ue(&bs) * crop_unit_x;
+    sps_info->crop_top    = nal_bs_read_ue(&bs) * crop_unit_y;
+    sps_info->crop_bottom = nal_bs_read_ue(&bs) * crop_unit_y;
+  }
+
+  if (nal_bs_read(&bs, 1))  // vui_parameters_present_flag
+  {
+    sps_parse_vui_head(&bs, sps_info);
+
+    sps_info->timing_info_present_flag = nal_bs_read(&bs, 1);
+    if (sps_info->timing_info_present_flag)
+    {
+      sps_info->num_units_in_tick     = nal_bs_read(&bs, 32);
+      sps_info->time_scale            = nal_bs_read(&bs, 32);
+      sps_info->fixed_frame_rate_flag = nal_bs_read(&bs, 1);
+    }
+
+    int nal_hrd_parameters_present_flag = nal_bs_read(&bs, 1);
+    if (nal_hrd_parameters_present_flag && !h264_skip_hrd(&bs))
+      return false;
+    int vcl_hrd_parameters_present_flag = nal_bs_read(&bs, 1);
+    if (vcl_hrd_parameters_present_flag && !h264_skip_hrd(&bs))
+      return false;
+    if (nal_hrd_parameters_present_flag || vcl_hrd_parameters_present_flag)
+      nal_bs_read(&bs, 1);  // low_delay_hrd_flag
+    nal_bs_read(&bs, 1);  // pic_struct_present_flag
+
+    sps_info->bitstream_restriction_flag = nal_bs_read(&bs, 1);
+    if (sps_info->bitstream_restriction_flag)
+    {
+      nal_bs_read(&bs, 1);  // motion_vectors_over_pic_boundaries_flag
+      nal_bs_read_ue(&bs);  // max_bytes_per_pic_denom
+      nal_bs_read_ue(&bs);  // max_bits_per_mb_denom
+      nal_bs_read_ue(&bs);  // log2_max_mv_length_horizontal
+      nal_bs_read_ue(&bs);  // log2_max_mv_length_vertical
+      sps_info->max_num_reorder_frames  = nal_bs_read_ue(&bs);
+      sps_info->max_dec_frame_buffering = nal_bs_read_ue(&bs);
+    }
+  }
+
+  return true;
+}
+
+bool CBitstreamConverter::parsehevc_sps(const uint8_t *sps, const uint32_t sps_size, sps_info_struct *sps_info)
+{
+  nal_bitstream bs;
+  int num_delta_pocs[64];
+
+  memset(sps_info, 0, sizeof(*sps_info));
+
   nal_bs_init(&bs, sps, sps_size);
 
-  sps_info.profile_idc  = nal_bs_read(&bs, 8);
-  nal_bs_read(&bs, 1);  // constraint_set0_flag
-  nal_bs_read(&bs, 1);  // constraint_set1_flag
-  nal_bs_read(&bs, 1);  // constraint_set2_flag
-  nal_bs_read(&bs, 1);  // constraint_set3_flag
-  nal_bs_read(&bs, 4);  // reserved
-  sps_info.level_idc    = nal_bs_read(&bs, 8);
-  sps_info.sps_id       = nal_bs_read_ue(&bs);
-
-  if (sps_info.profile_idc == 100 ||
-      sps_info.profile_idc == 110 ||
-      sps_info.profile_idc == 122 ||
-      sps_info.profile_idc == 244 ||
-      sps_info.profile_idc == 44  ||
-      sps_info.profile_idc == 83  ||
-      sps_info.profile_idc == 86)
-  {
-    sps_info.chroma_format_idc                    = nal_bs_read_ue(&bs);
-    if (sps_info.chroma_format_idc == 3)
-      sps_info.separate_colour_plane_flag         = nal_bs_read(&bs, 1);
-    sps_info.bit_depth_luma_minus8                = nal_bs_read_ue(&bs);
-    sps_info.bit_depth_chroma_minus8              = nal_bs_read_ue(&bs);
-    sps_info.qpprime_y_zero_transform_bypass_flag = nal_bs_read(&bs, 1);
-
-    sps_info.seq_scaling_matrix_present_flag = nal_bs_read (&bs, 1);
-    if (sps_info.seq_scaling_matrix_present_flag)
-    {
-      /* TODO: unfinished */
-    }
-  }
-  sps_info.log2_max_frame_num_minus4 = nal_bs_read_ue(&bs);
-  if (sps_info.log2_max_frame_num_minus4 > 12)
-  { // must be between 0 and 12
+  nal_bs_read(&bs, 4);                                      // sps_video_parameter_set_id
+  int max_sub_layers_minus1 = nal_bs_read(&bs, 3);
+  nal_bs_read(&bs, 1);                                      // sps_temporal_id_nesting_flag
+  hevc_skip_profile_tier_level(&bs, max_sub_layers_minus1, &sps_info->profile_idc, &sps_info->level_idc);
+  sps_info->max_sub_layers_minus1 = max_sub_layers_minus1;
+
+  sps_info->sps_id = nal_bs_read_ue(&bs);
+  if (sps_info->sps_id > 15)
+    return false;
+
+  sps_info->chroma_format_idc = nal_bs_read_ue(&bs);
+  if (sps_info->chroma_format_idc > 3)
+    return false;
+  int separate_colour_plane_flag = 0;
+  if (sps_info->chroma_format_idc == 3)
+    separate_colour_plane_flag = nal_bs_read(&bs, 1);
+  sps_info->separate_colour_plane = separate_colour_plane_flag;
+  sps_info->width  = nal_bs_read_ue(&bs);                   // pic_width_in_luma_samples
+  sps_info->height = nal_bs_read_ue(&bs);                   // pic_height_in_luma_samples
+
+  if (nal_bs_read(&bs, 1))                                  // conformance_window_flag
+  {
+    int chroma_array_type = separate_colour_plane_flag ? 0 : sps_info->chroma_format_idc;
+    int sub_width_c  = (chroma_array_type == 1 || chroma_array_type == 2) ? 2 : 1;
+    int sub_height_c = chroma_array_type == 1 ? 2 : 1;
+
+    sps_info->crop_left   = nal_bs_read_ue(&bs) * sub_width_c;
+    sps_info->crop_right  = nal_bs_read_ue(&bs) * sub_width_c;
+    sps_info->crop_top    = nal_bs_read_ue(&bs) * sub_height_c;
+    sps_info->crop_bottom = nal_bs_read_ue(&bs) * sub_height_c;
+  }
+  sps_info->bit_depth_luma   = nal_bs_read_ue(&bs) + 8;
+  sps_info->bit_depth_chroma = nal_bs_read_ue(&bs) + 8;
+  int log2_max_pic_order_cnt_lsb = nal_bs_read_ue(&bs) + 4;
+  if (log2_max_pic_order_cnt_lsb > 16)
+    return false;
+  sps_info->log2_max_poc_lsb = log2_max_pic_order_cnt_lsb;
+
+  // keep the values of the highest sub layer
+  int sub_layer_ordering_info_present_flag = nal_bs_read(&bs, 1);
+  for (int i = sub_layer_ordering_info_present_flag ? 0 : max_sub_layers_minus1; i <= max_sub_layers_minus1; i++)
+  {
+    sps_info->max_dec_frame_buffering = nal_bs_read_ue(&bs) + 1;
+    sps_info->max_num_reorder_frames  = nal_bs_read_ue(&bs);
+    nal_bs_read_ue(&bs);                                    // sps_max_latency_increase_plus1
+  }
+  sps_info->max_ref_frames = sps_info->max_dec_frame_buffering - 1;
+
+  nal_bs_read_ue(&bs);                                      // log2_min_luma_coding_block_size_minus3
+  nal_bs_read_ue(&bs);                                      // log2_diff_max_min_luma_coding_block_size
+  nal_bs_read_ue(&bs);                                      // log2_min_luma_transform_block_size_minus2
+  nal_bs_read_ue(&bs);                                      // log2_diff_max_min_luma_transform_block_size
+  nal_bs_read_ue(&bs);                                      // max_transform_hierarchy_depth_inter
+  nal_bs_read_ue(&bs);                                      // max_transform_hierarchy_depth_intra
+
+  if (nal_bs_read(&bs, 1) && nal_bs_read(&bs, 1))           // scaling_list_enabled_flag, sps_scaling_list_data_present_flag
+  {
+    for (int size_id = 0; size_id < 4; size_id++)
+    {
+      for (int matrix_id = 0; matrix_id < 6; matrix_id += (size_id == 3) ? 3 : 1)
+      {
+        if (!nal_bs_read(&bs, 1))                           // scaling_list_pred_mode_flag
+        {
+          nal_bs_read_ue(&bs);                              // scaling_list_pred_matrix_id_delta
+          continue;
+        }
+        int coef_num = FFMIN(64, 1 << (4 + (size_id << 1)));
+        if (size_id > 1)
+          nal_bs_read_se(&bs);                              // scaling_list_dc_coef_minus8
+        for (int i = 0; i < coef_num; i++)
+          nal_bs_read_se(&bs);                              // scaling_list_delta_coef
+      }
+    }
+  }
+  nal_bs_read(&bs, 1);                                      // amp_enabled_flag
+  nal_bs_read(&bs, 1);                                      // sample_adaptive_offset_enabled_flag
+  if (nal_bs_read(&bs, 1))                                  // pcm_enabled_flag
+  {
+    nal_bs_read(&bs, 8);                                    // pcm sample bit depths
+    nal_bs_read_ue(&bs);                                    // log2_min_pcm_luma_coding_block_size_minus3
+    nal_bs_read_ue(&bs);                                    // log2_diff_max_min_pcm_luma_coding_block_size
+    nal_bs_read(&bs, 1);                                    // pcm_loop_filter_disabled_flag
+  }
+
+  int num_short_term_ref_pic_sets = nal_bs_read_ue(&bs);
+  if (num_short_term_ref_pic_sets > 64)
+    return false;
+  for (int i = 0; i < num_short_term_ref_pic_sets; i++)
+  {
+    // st_ref_pic_set(i), only the number of delta pocs is needed to
+    // size the next set when it is predicted from this one.
+    if (i && nal_bs_read(&bs, 1))                           // inter_ref_pic_set_prediction_flag
+    {
+      nal_bs_read(&bs, 1);                                  // delta_rps_sign
+      nal_bs_read_ue(&bs);                                  // abs_delta_rps_minus1
+      num_delta_pocs[i] = 0;
+      for (int j = 0; j <= num_delta_pocs[i - 1]; j++)
+      {
+        int used_by_curr_pic_flag = nal_bs_read(&bs, 1);
+        int use_delta_flag = used_by_curr_pic_flag ? 1 : nal_bs_read(&bs, 1);
+        if (used_by_curr_pic_flag || use_delta_flag)
+          num_delta_pocs[i]++;
+      }
+    }
+    else
+    {
+      int num_negative_pics = nal_bs_read_ue(&bs);
+      int num_positive_pics = nal_bs_read_ue(&bs);
+      if (num_negative_pics > 16 || num_positive_pics > 16)
+        return false;
+      num_delta_pocs[i] = num_negative_pics + num_positive_pics;
+      for (int j = 0; j < num_delta_pocs[i]; j++)
+      {
+        nal_bs_read_ue(&bs);                                // delta_poc_minus1
+        nal_bs_read(&bs, 1);                                // used_by_curr_pic_flag
+      }
+    }
+  }
+
+  if (nal_bs_read(&bs, 1))                                  // long_term_ref_pics_present_flag
+  {
+    int num_long_term_ref_pics_sps = nal_bs_read_ue(&bs);
+    if (num_long_term_ref_pics_sps > 32)
+      return false;
+    for (int i = 0; i < num_long_term_ref_pics_sps; i++)
+    {
+      nal_bs_read(&bs, log2_max_pic_order_cnt_lsb);         // lt_ref_pic_poc_lsb_sps
+      nal_bs_read(&bs, 1);                                  // used_by_curr_pic_lt_sps_flag
+    }
+  }
+  nal_bs_read(&bs, 1);                                      // sps_temporal_mvp_enabled_flag
+  nal_bs_read(&bs, 1);                                      // strong_intra_smoothing_enabled_flag
+
+  if (nal_bs_read(&bs, 1))                                  // vui_parameters_present_flag
+  {
+    sps_parse_vui_head(&bs, sps_info);
+
+    nal_bs_read(&bs, 1);                                    // neutral_chroma_indication_flag
+    sps_info->interlaced = nal_bs_read(&bs, 1);             // field_seq_flag
+    nal_bs_read(&bs, 1);                                    // frame_field_info_present_flag
+    if (nal_bs_read(&bs, 1))                                // default_display_window_flag
+    {
+      nal_bs_read_ue(&bs);
+      nal_bs_read_ue(&bs);
+      nal_bs_read_ue(&bs);
+      nal_bs_read_ue(&bs);
+    }
+
+    sps_info->timing_info_present_flag = nal_bs_read(&bs, 1);
+    if (sps_info->timing_info_present_flag)
+    {
+      sps_info->num_units_in_tick = nal_bs_read(&bs, 32);
+      sps_info->time_scale        = nal_bs_read(&bs, 32);
+      if (nal_bs_read(&bs, 1))                              // vui_poc_proportional_to_timing_flag
+        nal_bs_read_ue(&bs);                                // vui_num_ticks_poc_diff_one_minus1
+      if (nal_bs_read(&bs, 1) &&                            // vui_hrd_parameters_present_flag
+          !hevc_skip_hrd(&bs, max_sub_layers_minus1, &sps_info->fixed_frame_rate_flag))
+        return false;
+    }
+
+    // hevc keeps the reorder and dpb limits in the sub layer ordering info
+    sps_info->bitstream_restriction_flag = nal_bs_read(&bs, 1);
+  }
+
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////
+const sps_info_struct* CBitstreamConverter::GetSPS(int sps_id) const
+{
+  if (sps_id < 0 || sps_id >= BS_MAX_SPS_COUNT || !m_param_sets.sps[sps_id].valid)
+    return NULL;
+  return &m_param_sets.sps_info[sps_id];
+}
+
+const sps_info_struct* CBitstreamConverter::GetLastSPS(void) const
+{
+  return GetSPS(m_param_sets.last_sps_id);
+}
+
+void CBitstreamConverter::InitParamSets(const uint8_t *in_extradata, int in_extrasize)
+{
+  // seed the store from the extradata, repeats of these sets in band are
+  // then no change. also remembers how Convert gets its nal units.
+  memset(&m_param_sets, 0, sizeof(m_param_sets));
+  m_param_sets.last_sps_id = -1;
+  m_param_sets_changed = false;
+  m_nal_length_size = 0;
+
+  if (m_codec != AV_CODEC_ID_H264 && m_codec != AV_CODEC_ID_HEVC)
     return;
+
+  if (m_to_annexb)
+  {
+    if (m_convert_bitstream)
+    {
+      m_nal_length_size = m_sps_pps_context.length_size;
+      if (m_sps_pps_context.sps_pps_data)
+        UpdateParamSets(m_sps_pps_context.sps_pps_data, m_sps_pps_context.size, 0);
+    }
+  }
+  else if (m_convert_bytestream)
+  {
+    UpdateParamSets(in_extradata, in_extrasize, 0);
   }
-  sps_info.pic_order_cnt_type = nal_bs_read_ue(&bs);
-  if (sps_info.pic_order_cnt_type == 0)
+  else if (m_extradata)
   {
-    sps_info.log2_max_pic_order_cnt_lsb_minus4 = nal_bs_read_ue(&bs);
+    // avcC or hvcC, walk the arrays of length prefixed parameter sets
+    const uint8_t *p = m_extradata;
+    const uint8_t *end = m_extradata + m_extrasize;
+    int arrays;
+
+    if (m_codec == AV_CODEC_ID_H264)
+    {
+      m_nal_length_size = (p[4] & 0x3) + 1;
+      p += 5;
+      arrays = 2;
+    }
+    else
+    {
+      m_nal_length_size = (p[21] & 0x3) + 1;
+      p += 22;
+      arrays = end - p > 0 ? *p++ : 0;
+    }
+    if (m_convert_3byteTo4byteNALSize)
+      m_nal_length_size = 3;
+
+    for (int i = 0; i < arrays && p < end; i++)
+    {
+      int units;
+      if (m_codec == AV_CODEC_ID_H264)
+      {
+        units = *p++ & (i ? 0xff : 0x1f);
+      }
+      else
+      {
+        if (end - p < 3)
+          break;
+        units = BS_RB16(p + 1);
+        p += 3;
+      }
+
+      while (units-- && end - p >= 2)
+      {
+        int unit_size = BS_RB16(p);
+        p += 2;
+        if (!unit_size || unit_size > end - p)
+          break;
+        uint8_t unit_type = m_codec == AV_CODEC_ID_H264 ? (*p & 0x1f) : ((*p >> 1) & 0x3f);
+        StoreParamSet(unit_type, p, unit_size);
+        p += unit_size;
+      }
+    }
   }
-  else if (sps_info.pic_order_cnt_type == 1)
-  { // TODO: unfinished
-    /*
-    delta_pic_order_always_zero_flag = gst_nal_bs_read (bs, 1);
-    offset_for_non_ref_pic = gst_nal_bs_read_se (bs);
-    offset_for_top_to_bottom_field = gst_nal_bs_read_se (bs);
 
-    num_ref_frames_in_pic_order_cnt_cycle = gst_nal_bs_read_ue (bs);
-    for( i = 0; i < num_ref_frames_in_pic_order_cnt_cycle; i++ )
-    offset_for_ref_frame[i] = gst_nal_bs_read_se (bs);
-    */
+  m_param_sets_changed = false;
+}
+
+bool CBitstreamConverter::UpdateParamSets(const uint8_t *data, int size, int length_size)
+{
+  // parameter sets precede the slices of the access unit they apply to,
+  // the walk stops at the first slice so big packets cost next to nothing.
+  const uint8_t *end = data + size;
+  const uint8_t *nal_start, *nal_end;
+  bool changed = false;
+
+  while (data < end)
+  {
+    if (length_size)
+    {
+      uint32_t nal_size = 0;
+      if (end - data < length_size)
+        break;
+      for (int i = 0; i < length_size; i++)
+        nal_size = (nal_size << 8) | data[i];
+      nal_start = data + length_size;
+      if (!nal_size || nal_size > (uint32_t)(end - nal_start))
+        break;
+      nal_end = nal_start + nal_size;
+    }
+    else
+    {
+      nal_start = avc_find_startcode(data, end);
+      while (nal_start < end && !*(nal_start++));
+      if (nal_start >= end)
+        break;
+      nal_end = NULL;
+    }
+
+    uint8_t unit_type;
+    if (m_codec == AV_CODEC_ID_H264)
+    {
+      unit_type = *nal_start & 0x1f;
+      if ((unit_type >= AVC_NAL_SLICE && unit_type <= AVC_NAL_IDR_SLICE) || unit_type == 20)
+        break;
+      if (unit_type != AVC_NAL_SPS && unit_type != AVC_NAL_PPS)
+        unit_type = 0;
+    }
+    else
+    {
+      unit_type = (*nal_start >> 1) & 0x3f;
+      if (unit_type < HEVC_NAL_VPS)
+        break;
+      if (unit_type != HEVC_NAL_VPS && unit_type != HEVC_NAL_SPS && unit_type != HEVC_NAL_PPS)
+        unit_type = 0;
+    }
+
+    if (!nal_end)
+      nal_end = avc_find_startcode(nal_start, end);
+    if (unit_type)
+      changed |= StoreParamSet(unit_type, nal_start, nal_end - nal_start);
+    data = nal_end;
   }
 
-  sps_info.max_num_ref_frames             = nal_bs_read_ue(&bs);
-  sps_info.gaps_in_frame_num_value_allowed_flag = nal_bs_read(&bs, 1);
-  sps_info.pic_width_in_mbs_minus1        = nal_bs_read_ue(&bs);
-  sps_info.pic_height_in_map_units_minus1 = nal_bs_read_ue(&bs);
+  m_param_sets_changed |= changed;
+  return changed;
+}
+
+bool CBitstreamConverter::StoreParamSet(uint8_t unit_type, const uint8_t *nal, int nal_size)
+{
+  // unit_type is AVC_NAL_SPS/PPS for h264 and HEVC_NAL_VPS/SPS/PPS for hevc
+  bool hevc = m_codec == AV_CODEC_ID_HEVC;
+  int header_size = hevc ? 2 : 1;
+  const uint8_t *rbsp = nal + header_size;
+  int rbsp_size = nal_size - header_size;
+  param_set_key *key;
+  bool sps = false;
+  int id;
+
+  if (rbsp_size < 1)
+    return false;
 
-  sps_info.frame_mbs_only_flag            = nal_bs_read(&bs, 1);
-  if (!sps_info.frame_mbs_only_flag)
-    sps_info.mb_adaptive_frame_field_flag = nal_bs_read(&bs, 1);
+  if (hevc && unit_type == HEVC_NAL_VPS)
+  {
+    id = rbsp[0] >> 4;
+    key = &m_param_sets.vps[id];
+  }
+  else if ((hevc && unit_type == HEVC_NAL_SPS) || (!hevc && unit_type == AVC_NAL_SPS))
+  {
+    id = hevc ? hevc_sps_id(rbsp, rbsp_size) : h264_sps_id(rbsp, rbsp_size);
+    if (id < 0 || id >= (hevc ? 16 : BS_MAX_SPS_COUNT))
+      return false;
+    key = &m_param_sets.sps[id];
+    sps = true;
+  }
+  else
+  {
+    nal_bitstream bs;
+    nal_bs_init(&bs, rbsp, rbsp_size);
+    id = nal_bs_read_ue(&bs);
+    if (id < 0 || id >= (hevc ? 64 : BS_MAX_PPS_COUNT))
+      return false;
+    key = &m_param_sets.pps[id];
+    m_param_sets.pps_sps_id[id] = nal_bs_read_ue(&bs);
+  }
 
-  sps_info.direct_8x8_inference_flag      = nal_bs_read(&bs, 1);
+  uint32_t hash = param_set_hash(nal, nal_size);
+  if (key->size == nal_size && key->hash == hash)
+  {
+    if (sps && key->valid)
+      m_param_sets.last_sps_id = id;
+    return false;
+  }
 
-  sps_info.frame_cropping_flag            = nal_bs_read(&bs, 1);
-  if (sps_info.frame_cropping_flag)
+  if (sps)
   {
-    sps_info.frame_crop_left_offset       = nal_bs_read_ue(&bs);
-    sps_info.frame_crop_right_offset      = nal_bs_read_ue(&bs);
-    sps_info.frame_crop_top_offset        = nal_bs_read_ue(&bs);
-    sps_info.frame_crop_bottom_offset     = nal_bs_read_ue(&bs);
+    sps_info_struct sps_info;
+    bool parsed = hevc ? parsehevc_sps(rbsp, rbsp_size, &sps_info) : parseh264_sps(rbsp, rbsp_size, &sps_info);
+    if (!parsed)
+    {
+      // remembered as broken, the repeats of it are not parsed again
+      CLog::Log(LOGDEBUG, "CBitstreamConverter::StoreParamSet: invalid sps %d", id);
+      key->hash = hash;
+      key->size = nal_size;
+      key->valid = false;
+      return false;
+    }
+    if (key->valid && (sps_info.width != m_param_sets.sps_info[id].width ||
+                       sps_info.height != m_param_sets.sps_info[id].height))
+    {
+      CLog::Log(LOGDEBUG, "CBitstreamConverter::StoreParamSet: sps %d changed %dx%d -> %dx%d", id,
+        m_param_sets.sps_info[id].width, m_param_sets.sps_info[id].height, sps_info.width, sps_info.height);
+    }
+    m_param_sets.sps_info[id] = sps_info;
+    m_param_sets.last_sps_id = id;
   }
 
-  *interlaced = !sps_info.frame_mbs_only_flag;
-  *max_ref_frames = sps_info.max_num_ref_frames;
+  key->hash = hash;
+  key->size = nal_size;
+  key->valid = true;
+  return true;
 }
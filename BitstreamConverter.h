@@ -25,8 +25,6 @@
 
 extern "C" {
 #include "libavutil/avutil.h"
-#include "libavformat/avformat.h"
-#include "libavfilter/avfilter.h"
 #include "libavcodec/avcodec.h"
 }
 
@@ -43,6 +41,11 @@ typedef struct {
   int      offbits, length, oflow;
 } bits_reader_t;
 
+typedef struct {
+  uint8_t *buf, *buf_ptr;
+  int      size;
+} byte_writer_t;
+
 ////////////////////////////////////////////////////////////////////////////////////////////
 // TODO: refactor this so as not to need these ffmpeg routines.
 // These are not exposed in ffmpeg's API so we dupe them here.
@@ -78,12 +81,39 @@ typedef struct {
   ((uint8_t*)(p))[2] = (d) >> 16; \
   ((uint8_t*)(p))[3] = (d) >> 24; }
 
+// Annex B start code scanning kernels load whole vectors and may read up to
+// BS_STARTCODE_PADDING bytes past the end of their input. Every buffer handed
+// to the Annex B parsers must be padded the same way ffmpeg pads packets.
+#define BS_STARTCODE_PADDING FF_INPUT_BUFFER_PADDING_SIZE
+
+// returns a pointer to the first 00 00 01 in [p, end) that is followed by at
+// least one more byte (a nal header) or end if there is none.
+typedef const uint8_t* (*bs_find_startcode_t)(const uint8_t *p, const uint8_t *end);
+
+typedef struct
+{
+  const char          *name;
+  bs_find_startcode_t  find;
+} bs_startcode_kernel;
+
+// random access point types, as stored in keyframe index files
+enum {
+  BS_RAP_NONE = 0,
+  BS_RAP_IDR  = 1,  // h264/hevc idr
+  BS_RAP_CRA  = 2,  // hevc cra and bla
+  BS_RAP_I    = 3   // h264 non idr I slice, mpeg2 I picture
+};
+
+// rbsp bit reader, cache holds head valid bits left aligned. zeros counts
+// the zero bytes last read to find emulation prevention bytes across refills.
 typedef struct
 {
   const uint8_t *data;
   const uint8_t *end;
   int head;
   uint64_t cache;
+  int zeros;
+  bool epb;
 } nal_bitstream;
 
 typedef struct mpeg2_sequence
@@ -96,40 +126,72 @@ typedef struct mpeg2_sequence
   uint32_t  ratio_info;
 } mpeg2_sequence;
 
+// sps fields shared by h264 and hevc, sizes and crops are in luma samples.
 typedef struct
 {
-  int profile_idc;
-  int level_idc;
-  int sps_id;
-
-  int chroma_format_idc;
-  int separate_colour_plane_flag;
-  int bit_depth_luma_minus8;
-  int bit_depth_chroma_minus8;
-  int qpprime_y_zero_transform_bypass_flag;
-  int seq_scaling_matrix_present_flag;
-
-  int log2_max_frame_num_minus4;
-  int pic_order_cnt_type;
-  int log2_max_pic_order_cnt_lsb_minus4;
-
-  int max_num_ref_frames;
-  int gaps_in_frame_num_value_allowed_flag;
-  int pic_width_in_mbs_minus1;
-  int pic_height_in_map_units_minus1;
-
-  int frame_mbs_only_flag;
-  int mb_adaptive_frame_field_flag;
-
-  int direct_8x8_inference_flag;
-
-  int frame_cropping_flag;
-  int frame_crop_left_offset;
-  int frame_crop_right_offset;
-  int frame_crop_top_offset;
-  int frame_crop_bottom_offset;
+  int       profile_idc;
+  int       level_idc;
+  int       sps_id;
+
+  int       chroma_format_idc;
+  int       bit_depth_luma;
+  int       bit_depth_chroma;
+
+  int       width;
+  int       height;
+  int       crop_left;
+  int       crop_right;
+  int       crop_top;
+  int       crop_bottom;
+
+  bool      interlaced;
+  int       max_ref_frames;
+
+  // slice header layout, the poc lsb size and colour planes also for hevc
+  int       log2_max_frame_num;
+  int       pic_order_cnt_type;
+  int       log2_max_poc_lsb;
+  bool      frame_mbs_only;
+  bool      separate_colour_plane;
+
+  // hevc temporal scalability
+  int       max_sub_layers_minus1;
+
+  // vui
+  int       sar_num;
+  int       sar_den;
+  bool      timing_info_present_flag;
+  uint32_t  num_units_in_tick;
+  uint32_t  time_scale;
+  bool      fixed_frame_rate_flag;
+  bool      bitstream_restriction_flag;
+  int       max_num_reorder_frames;
+  int       max_dec_frame_buffering;
 } sps_info_struct;
 
+#define BS_MAX_VPS_COUNT  16
+#define BS_MAX_SPS_COUNT  32
+#define BS_MAX_PPS_COUNT  256
+
+// a stored parameter set is only identified by its size and a hash of its
+// bytes, repeats of the same set are recognised without parsing them.
+typedef struct
+{
+  uint32_t  hash;
+  int       size;   // 0 for an empty slot
+  bool      valid;  // false for a set that failed to parse, its repeats are skipped as well
+} param_set_key;
+
+typedef struct
+{
+  param_set_key   vps[BS_MAX_VPS_COUNT];
+  param_set_key   sps[BS_MAX_SPS_COUNT];
+  param_set_key   pps[BS_MAX_PPS_COUNT];
+  sps_info_struct sps_info[BS_MAX_SPS_COUNT];
+  int             pps_sps_id[BS_MAX_PPS_COUNT];
+  int             last_sps_id;  // sps seen last, -1 before the first one
+} param_set_store;
+
 class CBitstreamParser
 {
 public:
@@ -139,11 +201,65 @@ public:
   static bool Open();
   static void Close();
   static bool FindIdrSlice(const uint8_t *buf, int buf_size);
+  // max_temporal_id is the highest hevc temporal sub-layer, -1 when unknown.
+  // sub-layer non-reference pictures below it are referenced from above.
+  static bool IsNonReferencePicture(enum AVCodecID codec, const uint8_t *buf, int buf_size, int max_temporal_id);
+  // length_size is the nal length size of bitstream packets, 0 for AnnexB
+  static int  GetRandomAccessType(enum AVCodecID codec, const uint8_t *buf, int buf_size, int length_size);
+  // picture size of the sps/sequence header in an AnnexB packet, cropped.
+  // false when the packet carries none before its first picture.
+  static bool GetPictureSize(enum AVCodecID codec, const uint8_t *buf, int buf_size, int *width, int *height);
+  static const uint8_t* FindStartCode(const uint8_t *p, const uint8_t *end);
+  static const bs_startcode_kernel* GetStartCodeKernels(int *count);
 
 protected:
   static const uint8_t* find_start_code(const uint8_t *p, const uint8_t *end, uint32_t *state);
 };
 
+// picture order of h264 and hevc AnnexB packets, tracked across packets
+// from the parameter sets and slice headers seen so far. a sequence starts
+// at each picture resetting the poc (IDR, BLA, the first CRA), the poc
+// orders the pictures of one sequence. h264 pictures with poc type 1 and
+// pictures of other codecs get sequence -1, no known order.
+class CPicOrderParser
+{
+public:
+  CPicOrderParser();
+
+  // forgets the order history, parameter sets stay (after a seek)
+  void Reset();
+  // stores the parameter sets of AnnexB or avcC extradata
+  void ParseExtraData(enum AVCodecID codec, const uint8_t *buf, int buf_size);
+  // true when buf holds a picture, always for codecs other than h264/hevc
+  bool Parse(enum AVCodecID codec, const uint8_t *buf, int buf_size, int *sequence, int *poc);
+
+private:
+  typedef struct
+  {
+    int  sps_id;                                    // -1 for an empty slot
+    // hevc slice header layout
+    bool dependent_slice_segments;
+    bool output_flag_present;
+    int  num_extra_slice_header_bits;
+  } pps_info;
+
+  void ParseParamSet(enum AVCodecID codec, const uint8_t *nal, int size);
+  void ParseSPS(enum AVCodecID codec, const uint8_t *rbsp, int size);
+  void ParsePPS(enum AVCodecID codec, const uint8_t *rbsp, int size);
+  bool ParseSlice(const uint8_t *rbsp, int size, int nal_ref_idc, bool idr, int *poc);
+  bool ParseSliceHEVC(const uint8_t *rbsp, int size, int nal_type, int temporal_id, int *poc);
+
+  sps_info_struct m_sps[BS_MAX_SPS_COUNT];
+  bool            m_spsValid[BS_MAX_SPS_COUNT];
+  pps_info        m_pps[BS_MAX_PPS_COUNT];
+  int             m_sequence;
+  int             m_prevPocMsb;
+  int             m_prevPocLsb;
+  int             m_frameCount;                     // poc type 2, pictures since the IDR
+  bool            m_firstPicture;                   // hevc, a CRA resets the poc after Reset
+  bool            m_pocTypeLogged;                  // h264 poc type 1 was reported
+};
+
 class CBitstreamConverter
 {
 public:
@@ -153,11 +269,21 @@ public:
   bool              Open(enum AVCodecID codec, uint8_t *in_extradata, int in_extrasize, bool to_annexb);
   void              Close(void);
   bool              NeedConvert(void) const { return m_convert_bitstream; };
+  // nal length size of the packets passed to Convert, 0 for AnnexB
+  int               GetNalLengthSize(void) const { return m_nal_length_size; };
+  // zero copy rewrites nal length fields/start codes in the buffer passed to
+  // Convert when the packet layout allows it, GetConvertBuffer then returns it.
+  void              SetZeroCopy(bool zerocopy) { m_zerocopy = zerocopy; };
   bool              Convert(uint8_t *pData, int iSize);
   uint8_t*          GetConvertBuffer(void) const;
   int               GetConvertSize() const;
   uint8_t*          GetExtraData(void) const;
   int               GetExtraSize() const;
+  // parameter sets from the extradata and in band, indexed by id. true after
+  // a Convert that brought a vps/sps/pps not stored under its id before.
+  bool              ParamSetsChanged(void) const { return m_param_sets_changed; };
+  const sps_info_struct* GetSPS(int sps_id) const;
+  const sps_info_struct* GetLastSPS(void) const;
 
   static void       bits_reader_set( bits_reader_t *br, uint8_t *buf, int len );
   static uint32_t   read_bits( bits_reader_t *br, int nbits );
@@ -170,20 +296,30 @@ public:
   static void       flush_bits(bits_writer_t *s);
 
   static void       parseh264_sps(const uint8_t *sps, const uint32_t sps_size, bool *interlaced, int32_t *max_ref_frames);
+  static bool       parseh264_sps(const uint8_t *sps, const uint32_t sps_size, sps_info_struct *sps_info);
+  static bool       parsehevc_sps(const uint8_t *sps, const uint32_t sps_size, sps_info_struct *sps_info);
   static bool       mpeg2_sequence_header(const uint8_t *data, const uint32_t size, mpeg2_sequence *sequence);
 
 protected:
-  static const int  avc_parse_nal_units(AVIOContext *pb, const uint8_t *buf_in, int size);
+  static const int  avc_parse_nal_units(byte_writer_t *bw, const uint8_t *buf_in, int size);
   static const int  avc_parse_nal_units_buf(const uint8_t *buf_in, uint8_t **buf, int *size);
-  const int         isom_write_avcc(AVIOContext *pb, const uint8_t *data, int len);
+  const int         isom_write_avcc(byte_writer_t *bw, const uint8_t *data, int len);
+  const int         isom_write_hvcc(byte_writer_t *bw, const uint8_t *data, int len);
   // bitstream to bytestream (Annex B) conversion support.
   bool              IsIDR(uint8_t unit_type);
   bool              IsSlice(uint8_t unit_type);
   bool              BitstreamConvertInitAVC(void *in_extradata, int in_extrasize);
   bool              BitstreamConvertInitHEVC(void *in_extradata, int in_extrasize);
-  bool              BitstreamConvert(uint8_t* pData, int iSize, uint8_t **poutbuf, int *poutbuf_size);
-  static void       BitstreamAllocAndCopy(uint8_t **poutbuf, int *poutbuf_size,
+  int               BitstreamConvertSize(const uint8_t *pData, int iSize, bool *sps_pps_inject);
+  bool              BitstreamConvert(uint8_t* pData, int iSize, uint8_t *poutbuf, int *poutbuf_size);
+  void              BitstreamConvertInPlace(uint8_t *pData, int iSize);
+  bool              BytestreamConvertInPlace(uint8_t *pData, int iSize);
+  static void       BitstreamCopy(uint8_t *poutbuf, int *poutbuf_size,
                       const uint8_t *sps_pps, uint32_t sps_pps_size, const uint8_t *in, uint32_t in_size);
+  bool              AllocConvertBuffer(int size);
+  void              InitParamSets(const uint8_t *in_extradata, int in_extrasize);
+  bool              UpdateParamSets(const uint8_t *data, int size, int length_size);
+  bool              StoreParamSet(uint8_t unit_type, const uint8_t *nal, int nal_size);
 
   typedef struct omx_bitstream_ctx {
       uint8_t  length_size;
@@ -193,8 +329,11 @@ protected:
       uint32_t size;
   } omx_bitstream_ctx;
 
+  // m_convertBuffer is owned by the converter and reused across packets,
+  // it only grows when a packet does not fit into m_convertBufferSize.
   uint8_t          *m_convertBuffer;
   int               m_convertSize;
+  int               m_convertBufferSize;
   uint8_t          *m_inputBuffer;
   int               m_inputSize;
 
@@ -207,7 +346,13 @@ protected:
   int               m_extrasize;
   bool              m_convert_3byteTo4byteNALSize;
   bool              m_convert_bytestream;
+  bool              m_zerocopy;
   AVCodecID         m_codec;
+
+  // nal length size of the packets passed to Convert, 0 for AnnexB
+  int               m_nal_length_size;
+  param_set_store   m_param_sets;
+  bool              m_param_sets_changed;
 };
 
 #endif
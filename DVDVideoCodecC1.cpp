@@ -29,9 +29,30 @@
 #endif
 #define CLASSNAME "CDVDVideoCodecC1"
 
+static int nal_length_size(enum AVCodecID codec, const uint8_t *extradata, int extrasize)
+{
+  // avcC/hvcC extradata means length prefixed packets, anything else AnnexB
+  if (!extradata || extrasize < 7)
+    return 0;
+  if (codec == AV_CODEC_ID_H264 && extradata[0] == 1)
+    return (extradata[4] & 0x3) + 1;
+  if (codec == AV_CODEC_ID_HEVC && extrasize >= 23 &&
+      (extradata[0] || extradata[1] || extradata[2] > 1))
+    return (extradata[21] & 0x3) + 1;
+  return 0;
+}
+
 CDVDVideoCodecC1::CDVDVideoCodecC1() :
   m_Codec(NULL),
-  m_pFormatName("c1-none")
+  m_software(NULL),
+  m_pFormatName("c1-none"),
+  m_nalLengthSize(0),
+  m_captureFormat(V4L2_PIX_FMT_RGB32),
+  m_device(ION_VIDEO_DEVICE),
+  m_bufferLow(BUFFER_DEFAULT_LOW),
+  m_bufferHigh(BUFFER_DEFAULT_HIGH),
+  m_trickLastPts(DVD_NOPTS_VALUE),
+  m_speed(DVD_PLAYSPEED_NORMAL)
 {
   m_bitstream = new CBitstreamConverter;
   memzero(m_videobuffer);
@@ -47,13 +68,17 @@ CDVDVideoCodecC1::~CDVDVideoCodecC1()
 bool CDVDVideoCodecC1::Open(CDVDStreamInfo &hints, CDVDCodecOptions &options)
 {
   m_hints = hints;
+  m_bVideoConvert = false;
+  m_speed = DVD_PLAYSPEED_NORMAL;
+  // trick play classifies the packets as demuxed, with or without the converter
+  m_nalLengthSize = nal_length_size(m_hints.codec, (const uint8_t*)m_hints.extradata, m_hints.extrasize);
   if (m_hints.software)
-    return false;
+    return OpenSoftware();
 
   if (!aml_permissions())
   {
     CLog::Log(LOGERROR, "AML: no proper permission, please contact the device vendor. Skipping codec...");
-    return false;
+    return OpenSoftware();
   }
 
   switch(m_hints.codec)
@@ -75,15 +100,18 @@ bool CDVDVideoCodecC1::Open(CDVDStreamInfo &hints, CDVDCodecOptions &options)
       break;
     default:
       CLog::Log(LOGDEBUG, "%s: Unknown hints.codec id: %d", CLASSNAME, m_hints.codec);
-      return false;
+      return OpenSoftware();
       break;
   }
 
+  // demuxer packets are consumed by Decode, let the converter rewrite them in place
+  m_bitstream->SetZeroCopy(true);
   m_bVideoConvert = m_bitstream->Open(m_hints.codec, (uint8_t*)m_hints.extradata, m_hints.extrasize, true);
   if (m_bVideoConvert) {
     m_hints.extrasize = m_bitstream->GetExtraSize();
     free(m_hints.extradata);
-    m_hints.extradata = malloc(m_hints.extrasize);
+    // padded, the start code scanners read past the end
+    m_hints.extradata = calloc(1, m_hints.extrasize + BS_STARTCODE_PADDING);
     memcpy(m_hints.extradata, m_bitstream->GetExtraData(), m_hints.extrasize);
   }
 
@@ -94,9 +122,29 @@ bool CDVDVideoCodecC1::Open(CDVDStreamInfo &hints, CDVDCodecOptions &options)
     return false;
   }
 
+  if (!m_Codec->SetCaptureFormat(m_captureFormat))
+  {
+    delete m_Codec, m_Codec = NULL;
+    return false;
+  }
+  m_Codec->SetDevice(m_device);
+  m_Codec->SetBufferWatermarks(m_bufferLow, m_bufferHigh);
+
+  // output comes in bursts as deep as the reordering, size the frame pool for it
+  const sps_info_struct *sps = m_bitstream->GetLastSPS();
+  if (sps)
+    m_Codec->SetReorderDepth(sps->bitstream_restriction_flag ? sps->max_num_reorder_frames : sps->max_ref_frames);
+
+  // ppmgr scales big streams down to the display, the renderer then samples
+  // smaller frames and the carveout holds smaller buffers
+  const RESOLUTION_INFO &res = CDisplaySettings::GetInstance().GetCurrentResolutionInfo();
+  m_Codec->SetOutputSize(res.iWidth, res.iHeight);
+
+  // the decoder is busy or rejects the stream, libavcodec decodes it
   if (!m_Codec->OpenDecoder(m_hints)) {
     CLog::Log(LOGERROR, "%s: Failed to open C1 Amlogic Codec", CLASSNAME);
-    return false;
+    delete m_Codec, m_Codec = NULL;
+    return OpenSoftware();
   }
 
   memzero(m_videobuffer);
@@ -125,10 +173,35 @@ bool CDVDVideoCodecC1::Open(CDVDStreamInfo &hints, CDVDCodecOptions &options)
   return true;
 }
 
+bool CDVDVideoCodecC1::OpenSoftware(void)
+{
+  // libavcodec takes the packets as demuxed, the extradata kept by the
+  // converter is a copy of the original avcC/hvcC
+  if (m_bVideoConvert)
+    m_bitstream->Close(), m_bVideoConvert = false;
+
+  m_software = new CSoftwareDecoder();
+  if (!m_software->Open(m_hints))
+  {
+    CLog::Log(LOGERROR, "%s: Failed to open software decoder", CLASSNAME);
+    delete m_software, m_software = NULL;
+    return false;
+  }
+
+  m_pFormatName = m_software->GetName();
+  CLog::Log(LOGNOTICE, "%s::%s Opened %s", CLASSNAME, __func__, m_pFormatName);
+  return true;
+}
+
 void CDVDVideoCodecC1::Dispose(void)
 {
   if (m_Codec)
     m_Codec->CloseDecoder(), delete m_Codec, m_Codec = NULL;
+  if (m_software)
+    delete m_software, m_software = NULL;
+  // a reopen converts with the extradata of the next stream
+  if (m_bitstream)
+    m_bitstream->Close();
   if (m_videobuffer.iFlags)
     m_videobuffer.iFlags = 0;
 }
@@ -139,25 +212,49 @@ int CDVDVideoCodecC1::Decode(uint8_t *pData, int iSize, double dts, double pts)
   if (m_hints.ptsinvalid)
     pts = DVD_NOPTS_VALUE;
 
+  // trick play skips everything but spaced out keyframes before the
+  // conversion, pictures already decoded are still handed out
+  int dropped = 0;
+  if (pData && !IsTrickPlayPacket(pData, iSize, pts))
+  {
+    pData = NULL, iSize = 0;
+    dts = pts = DVD_NOPTS_VALUE;
+    dropped = VC_DROPPED;
+  }
+
   if (pData)
   {
     if (m_bVideoConvert) {
       m_bitstream->Convert(pData, iSize);
       pData = m_bitstream->GetConvertBuffer();
       iSize = m_bitstream->GetConvertSize();
+      // the sub-layers of the current sps decide which pictures are droppable
+      const sps_info_struct *sps = m_bitstream->GetLastSPS();
+      if (m_Codec && sps && m_hints.codec == AV_CODEC_ID_HEVC)
+        m_Codec->SetMaxTemporalId(sps->max_sub_layers_minus1);
     }
   }
 
-  return m_Codec->Decode(pData, iSize, dts, pts);
+  if (m_software)
+    return m_software->Decode(pData, iSize, dts, pts) | dropped;
+  return m_Codec->Decode(pData, iSize, dts, pts) | dropped;
 }
 
 void CDVDVideoCodecC1::Reset(void)
 {
-  m_Codec->Reset();
+  m_trickLastPts = DVD_NOPTS_VALUE;
+  if (m_software)
+    m_software->Reset();
+  else
+    m_Codec->Reset();
 }
 
 bool CDVDVideoCodecC1::GetPicture(DVDVideoPicture* pDvdVideoPicture)
 {
+  // software pictures point into the decoder frame pool, not the capture buffers
+  if (m_software)
+    return m_software->GetPicture(pDvdVideoPicture);
+
   m_Codec->GetPicture(&m_videobuffer);
   *pDvdVideoPicture = m_videobuffer;
 
@@ -166,10 +263,76 @@ bool CDVDVideoCodecC1::GetPicture(DVDVideoPicture* pDvdVideoPicture)
 
 void CDVDVideoCodecC1::SetDropState(bool bDrop)
 {
+  // non reference pictures are dropped before they are written to the decoder
+  if (m_Codec)
+    m_Codec->SetDropState(bDrop);
+  if (m_software)
+    m_software->SetDropState(bDrop);
+}
+
+int CDVDVideoCodecC1::WaitForPictures(int timeout)
+{
+  if (m_Codec)
+    return m_Codec->WaitForPictures(timeout);
+  if (m_software)
+    return m_software->WaitForPictures(timeout);
+  return -1;
+}
+
+void CDVDVideoCodecC1::SetEndOfStream()
+{
+  // the hardware hands out everything written without being told
+  if (m_software)
+    m_software->Drain();
+}
+
+void CDVDVideoCodecC1::SetBufferWatermarks(double low, double high)
+{
+  m_bufferLow = low;
+  m_bufferHigh = high;
+  if (m_Codec)
+    m_Codec->SetBufferWatermarks(low, high);
 }
 
 void CDVDVideoCodecC1::SetSpeed(int iSpeed)
 {
+  m_trickLastPts = DVD_NOPTS_VALUE;
+  m_speed = iSpeed;
   if (m_Codec)
     m_Codec->SetSpeed(iSpeed);
 }
+
+bool CDVDVideoCodecC1::IsTrickPlayPacket(const uint8_t *pData, int iSize, double pts)
+{
+  int speed = m_speed;
+  if (speed == DVD_PLAYSPEED_NORMAL || speed == DVD_PLAYSPEED_PAUSE)
+    return true;
+
+  // codecs the parser can not classify are left to the hardware trick mode
+  switch (m_hints.codec)
+  {
+    case AV_CODEC_ID_H264:
+    case AV_CODEC_ID_HEVC:
+    case AV_CODEC_ID_MPEG1VIDEO:
+    case AV_CODEC_ID_MPEG2VIDEO:
+      break;
+    default:
+      return true;
+  }
+
+  if (CBitstreamParser::GetRandomAccessType(m_hints.codec, pData, iSize, m_nalLengthSize) == BS_RAP_NONE)
+    return false;
+
+  // one keyframe per TRICK_FRAME_TIME of wall time at the requested speed,
+  // the decoder never works on pictures that would not be shown
+  if (pts != DVD_NOPTS_VALUE && m_trickLastPts != DVD_NOPTS_VALUE)
+  {
+    double stride = fabs((double)speed / DVD_PLAYSPEED_NORMAL) * TRICK_FRAME_TIME * DVD_TIME_BASE / 1000;
+    if (fabs(pts - m_trickLastPts) < stride)
+      return false;
+  }
+  if (pts != DVD_NOPTS_VALUE)
+    m_trickLastPts = pts;
+
+  return true;
+}
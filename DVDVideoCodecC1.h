@@ -9,13 +9,7 @@
   #include "xbmcstubs.h"
   #include "LinuxC1Codec.h"
 #endif
-
-typedef struct frame_queue {
-  double dts;
-  double pts;
-  double sort_time;
-  struct frame_queue *nextframe;
-} frame_queue;
+#include "SoftwareDecoder.h"
 
 class CDVDVideoCodecC1 : public CDVDVideoCodec
 {
@@ -31,14 +25,34 @@ public:
   virtual bool GetPicture(DVDVideoPicture *pDvdVideoPicture);
   virtual void SetSpeed(int iSpeed);
   virtual void SetDropState(bool bDrop);
+  int          WaitForPictures(int timeout);
+  // no more packets follow, the pictures still held are flushed out
+  void         SetEndOfStream();
+  // before Open, see CLinuxC1Codec::SetCaptureFormat
+  void         SetCaptureFormat(uint32_t format) { m_captureFormat = format; }
+  // before Open, see CLinuxC1Codec::SetDevice
+  void         SetDevice(const std::string &device) { m_device = device; }
+  // see CLinuxC1Codec::SetBufferWatermarks
+  void         SetBufferWatermarks(double low, double high);
   virtual const char* GetName(void) { return (const char*)m_pFormatName; }
 
 protected:
+  bool            OpenSoftware(void);
+  bool            IsTrickPlayPacket(const uint8_t *pData, int iSize, double pts);
+
   CLinuxC1Codec  *m_Codec;
+  CSoftwareDecoder *m_software;  // set instead of m_Codec when the hardware can not take the stream
   const char     *m_pFormatName;
   DVDVideoPicture m_videobuffer;
   CDVDStreamInfo  m_hints;
 
   CBitstreamConverter *m_bitstream;
   bool                 m_bVideoConvert;
+  int                  m_nalLengthSize;  // of the demuxed packets, 0 for AnnexB
+  uint32_t             m_captureFormat;
+  std::string          m_device;
+  double               m_bufferLow;
+  double               m_bufferHigh;
+  double               m_trickLastPts;   // last keyframe forwarded in trick play
+  int                  m_speed;
 };
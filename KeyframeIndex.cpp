@@ -0,0 +1,248 @@
+#include "system.h"
+
+#include "KeyframeIndex.h"
+#include "BitstreamConverter.h"
+
+extern "C" {
+#include "libavformat/avformat.h"
+}
+
+#include <vector>
+
+#ifdef CLASSNAME
+#undef CLASSNAME
+#endif
+#define CLASSNAME "CKeyframeIndex"
+
+static bool media_stat(const std::string &mediaPath, int64_t *size, int64_t *mtime)
+{
+  struct stat st;
+  if (stat(mediaPath.c_str(), &st) < 0)
+    return false;
+
+  *size = st.st_size;
+  *mtime = st.st_mtime;
+  return true;
+}
+
+static int nal_length_size(const AVCodecParameters *par)
+{
+  // avcC/hvcC extradata means length prefixed packets, anything else AnnexB
+  const uint8_t *extradata = par->extradata;
+  int extrasize = par->extradata_size;
+
+  if (!extradata || extrasize < 7)
+    return 0;
+  if (par->codec_id == AV_CODEC_ID_H264 && extradata[0] == 1)
+    return (extradata[4] & 0x3) + 1;
+  if (par->codec_id == AV_CODEC_ID_HEVC && extrasize >= 23 &&
+      (extradata[0] || extradata[1] || extradata[2] > 1))
+    return (extradata[21] & 0x3) + 1;
+  return 0;
+}
+
+CKeyframeIndex::CKeyframeIndex() :
+  m_map(NULL),
+  m_mapSize(0),
+  m_header(NULL),
+  m_entries(NULL),
+  m_count(0)
+{
+}
+
+CKeyframeIndex::~CKeyframeIndex()
+{
+  Close();
+}
+
+std::string CKeyframeIndex::GetIndexPath(const std::string &mediaPath)
+{
+  return mediaPath + KF_INDEX_EXTENSION;
+}
+
+bool CKeyframeIndex::Build(const std::string &mediaPath, const std::string &indexPath)
+{
+  AVFormatContext *formatCtx = NULL;
+  kf_index_header header;
+  std::vector<kf_index_entry> entries;
+  int videoStream = -1;
+
+  memzero(header);
+  memcpy(header.magic, KF_INDEX_MAGIC, sizeof(KF_INDEX_MAGIC));
+  header.version = KF_INDEX_VERSION;
+  if (!media_stat(mediaPath, &header.media_size, &header.media_mtime))
+  {
+    CLog::Log(LOGERROR, "%s::%s - cannot stat %s: %s", CLASSNAME, __func__, mediaPath.c_str(), strerror(errno));
+    return false;
+  }
+
+  if (avformat_open_input(&formatCtx, mediaPath.c_str(), NULL, NULL) != 0)
+  {
+    CLog::Log(LOGERROR, "%s::%s - avformat_open_input() unable to open: %s", CLASSNAME, __func__, mediaPath.c_str());
+    return false;
+  }
+  if (avformat_find_stream_info(formatCtx, NULL) < 0)
+  {
+    CLog::Log(LOGERROR, "%s::%s - avformat_find_stream_info() failed.", CLASSNAME, __func__);
+    avformat_close_input(&formatCtx);
+    return false;
+  }
+
+  // only the video stream is demuxed, the demuxer skips everything else
+  for (unsigned int i = 0; i < formatCtx->nb_streams; ++i)
+  {
+    if (videoStream < 0 && formatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+      videoStream = i;
+    else
+      formatCtx->streams[i]->discard = AVDISCARD_ALL;
+  }
+  if (videoStream < 0)
+  {
+    CLog::Log(LOGERROR, "%s::%s - Unable to find video stream in %s", CLASSNAME, __func__, mediaPath.c_str());
+    avformat_close_input(&formatCtx);
+    return false;
+  }
+
+  AVStream *stream = formatCtx->streams[videoStream];
+  AVCodecID codec = stream->codecpar->codec_id;
+  int length_size = nal_length_size(stream->codecpar);
+  header.codec = codec;
+  header.time_base_num = stream->time_base.num;
+  header.time_base_den = stream->time_base.den;
+
+  AVPacket packet;
+  av_init_packet(&packet);
+  while (av_read_frame(formatCtx, &packet) >= 0)
+  {
+    // without pts or dts the entry would break the pts order FindKeyframe
+    // searches and can not be stepped from in trick play
+    bool timed = packet.pts != AV_NOPTS_VALUE || packet.dts != AV_NOPTS_VALUE;
+    if (packet.stream_index == videoStream && packet.pos >= 0 && timed)
+    {
+      int type = CBitstreamParser::GetRandomAccessType(codec, packet.data, packet.size, length_size);
+      if (type != BS_RAP_NONE)
+      {
+        kf_index_entry entry;
+        entry.offset   = packet.pos;
+        entry.pts      = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+        entry.type     = type;
+        entry.reserved = 0;
+        entries.push_back(entry);
+      }
+    }
+    av_packet_unref(&packet);
+  }
+  avformat_close_input(&formatCtx);
+
+  // write next to the final name and rename, a reader never maps a partial index
+  header.count = entries.size();
+  std::string tmpPath = indexPath + ".tmp";
+  FILE *file = fopen(tmpPath.c_str(), "wb");
+  if (!file)
+  {
+    CLog::Log(LOGERROR, "%s::%s - cannot create %s: %s", CLASSNAME, __func__, tmpPath.c_str(), strerror(errno));
+    return false;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  if (ok && !entries.empty())
+    ok = fwrite(entries.data(), sizeof(kf_index_entry), entries.size(), file) == entries.size();
+  ok = (fclose(file) == 0) && ok;
+  if (!ok || rename(tmpPath.c_str(), indexPath.c_str()) < 0)
+  {
+    CLog::Log(LOGERROR, "%s::%s - cannot write %s: %s", CLASSNAME, __func__, indexPath.c_str(), strerror(errno));
+    unlink(tmpPath.c_str());
+    return false;
+  }
+
+  CLog::Log(LOGDEBUG, "%s::%s - %s: %d random access points", CLASSNAME, __func__, indexPath.c_str(), (int)entries.size());
+  return true;
+}
+
+bool CKeyframeIndex::Open(const std::string &mediaPath)
+{
+  Close();
+
+  std::string indexPath = GetIndexPath(mediaPath);
+  int64_t media_size, media_mtime;
+  if (!media_stat(mediaPath, &media_size, &media_mtime))
+    return false;
+
+  int fd = open(indexPath.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(kf_index_header))
+  {
+    close(fd);
+    return false;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    CLog::Log(LOGERROR, "%s::%s - cannot map %s: %s", CLASSNAME, __func__, indexPath.c_str(), strerror(errno));
+    return false;
+  }
+  m_map = map;
+  m_mapSize = st.st_size;
+
+  const kf_index_header *header = (const kf_index_header*)map;
+  if (memcmp(header->magic, KF_INDEX_MAGIC, sizeof(KF_INDEX_MAGIC)) != 0 ||
+      header->version != KF_INDEX_VERSION ||
+      header->count > (m_mapSize - sizeof(kf_index_header)) / sizeof(kf_index_entry))
+  {
+    CLog::Log(LOGERROR, "%s::%s - invalid index %s", CLASSNAME, __func__, indexPath.c_str());
+    Close();
+    return false;
+  }
+  if (header->media_size != media_size || header->media_mtime != media_mtime)
+  {
+    CLog::Log(LOGDEBUG, "%s::%s - stale index %s", CLASSNAME, __func__, indexPath.c_str());
+    Close();
+    return false;
+  }
+
+  m_header = header;
+  m_entries = (const kf_index_entry*)(header + 1);
+  m_count = header->count;
+  return true;
+}
+
+void CKeyframeIndex::Close()
+{
+  if (m_map)
+    munmap(m_map, m_mapSize);
+  m_map = NULL;
+  m_mapSize = 0;
+  m_header = NULL;
+  m_entries = NULL;
+  m_count = 0;
+}
+
+void CKeyframeIndex::GetTimeBase(int *num, int *den) const
+{
+  *num = m_header ? m_header->time_base_num : 0;
+  *den = m_header ? m_header->time_base_den : 1;
+}
+
+const kf_index_entry* CKeyframeIndex::FindKeyframe(int64_t pts) const
+{
+  // random access points are presented in file order, so their pts
+  // ascend with the offset and a binary search is enough.
+  if (!m_count)
+    return NULL;
+
+  size_t lo = 0, hi = m_count;
+  while (hi - lo > 1)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    if (m_entries[mid].pts <= pts)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  return &m_entries[lo];
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+// keyframe index file, written next to the media as <media>.mfcidx. the
+// file is a header followed by the entries sorted by offset, it is mapped
+// as is so the layout must not change without bumping the version.
+#define KF_INDEX_MAGIC      "MFCKIDX"
+#define KF_INDEX_VERSION    2   // 2: entries without a timestamp are left out
+#define KF_INDEX_EXTENSION  ".mfcidx"
+
+typedef struct
+{
+  char      magic[8];
+  uint32_t  version;
+  uint32_t  codec;          // AVCodecID of the indexed stream
+  int64_t   media_size;     // the index is stale when size or mtime differ
+  int64_t   media_mtime;
+  int32_t   time_base_num;  // time base of the entry pts
+  int32_t   time_base_den;
+  uint64_t  count;
+} kf_index_header;
+
+typedef struct
+{
+  int64_t   offset;         // byte offset of the packet in the media file
+  int64_t   pts;            // pts, dts when the packet has none
+  uint32_t  type;           // BS_RAP_IDR, BS_RAP_CRA or BS_RAP_I
+  uint32_t  reserved;
+} kf_index_entry;
+
+class CKeyframeIndex
+{
+public:
+  CKeyframeIndex();
+  ~CKeyframeIndex();
+
+  static std::string GetIndexPath(const std::string &mediaPath);
+  // demuxes the video stream of mediaPath once and writes its index
+  static bool Build(const std::string &mediaPath, const std::string &indexPath);
+
+  // maps the index of mediaPath, fails when it is missing or stale
+  bool      Open(const std::string &mediaPath);
+  void      Close();
+
+  size_t    GetCount() const { return m_count; }
+  const kf_index_entry* GetEntry(size_t i) const { return i < m_count ? &m_entries[i] : NULL; }
+  int       GetCodec() const { return m_header ? m_header->codec : 0; }
+  void      GetTimeBase(int *num, int *den) const;
+  // last random access point at or before pts, the first one if there is none
+  const kf_index_entry* FindKeyframe(int64_t pts) const;
+
+private:
+  void                 *m_map;
+  size_t                m_mapSize;
+  const kf_index_header *m_header;
+  const kf_index_entry  *m_entries;
+  size_t                m_count;
+};
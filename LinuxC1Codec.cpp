@@ -57,7 +57,7 @@ public:
     p.events = POLLERR | POLLIN;
 
     return poll(&p, 1, timeout);
-}
+  }
 
 
 private:
@@ -226,47 +226,340 @@ private:
   size_t       m_length;
 };
 
+typedef std::shared_ptr<IonBuffer> IonBufferPtr;
+
+// process wide cache of idle ION buffers. frames of a closed decoder give
+// their buffers back here, the next session takes them as they are, mapped
+// and shared, instead of going through ALLOC/SHARE/mmap and fragmenting the
+// carveout heap. idle buffers are evicted least recently used first once
+// everything allocated through the pool exceeds the cap.
+class IonBufferPool
+{
+public:
+  static IonBufferPool &GetInstance()
+  {
+    static IonBufferPool pool;
+    return pool;
+  }
+
+  // an idle buffer of at least len bytes and less than a quarter larger,
+  // a new one when there is none
+  IonBufferPtr Acquire(size_t len)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::list<IonBufferPtr>::iterator best = m_idle.end();
+    for (std::list<IonBufferPtr>::iterator it = m_idle.begin(); it != m_idle.end(); ++it)
+    {
+      size_t length = (*it)->GetLength();
+      if (length >= len && length <= len + len / 4 &&
+          (best == m_idle.end() || length < (*best)->GetLength()))
+        best = it;
+    }
+    if (best != m_idle.end())
+    {
+      IonBufferPtr buffer = *best;
+      m_idle.erase(best);
+      return buffer;
+    }
+
+    if (!m_ionFile)
+    {
+      PosixFilePtr ionFile = std::make_shared<PosixFile>();
+      if (!ionFile->Open("/dev/ion", O_RDWR))
+      {
+        CLog::Log(LOGERROR, "IonBufferPool::Acquire - cannot open ION memory management device /dev/ion: %s", strerror(errno));
+        return nullptr;
+      }
+      m_ionFile = ionFile;
+    }
+
+    Evict(len);
+
+    IonBufferPtr buffer = std::make_shared<IonBuffer>(m_ionFile);
+    if (!buffer->Allocate(len))
+      return nullptr;
+    m_allocated += buffer->GetLength();
+    return buffer;
+  }
+
+  void Release(IonBufferPtr buffer)
+  {
+    if (!buffer || !buffer->GetData())
+      return;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_idle.push_front(buffer);
+    Evict(0);
+  }
+
+  void SetCap(size_t cap)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_cap = cap;
+    Evict(0);
+  }
+
+private:
+  IonBufferPool() :
+    m_cap(ION_POOL_DEFAULT_CAP),
+    m_allocated(0)
+  {
+  }
+
+  // frees idle buffers, oldest first, until len more bytes fit under the cap
+  void Evict(size_t len)
+  {
+    while (!m_idle.empty() && m_allocated + len > m_cap)
+    {
+      m_allocated -= m_idle.back()->GetLength();
+      m_idle.pop_back();
+    }
+  }
+
+  std::mutex              m_mutex;
+  PosixFilePtr            m_ionFile;
+  std::list<IonBufferPtr> m_idle;       // most recently released first
+  size_t                  m_cap;
+  size_t                  m_allocated;  // idle and in use
+};
+
 class VideoFrame
 {
 public:
-  VideoFrame(PosixFilePtr ionFile, int index) :
-    m_ionBuffer(ionFile),
+  VideoFrame(int index) :
     m_index(index),
     m_width(0),
     m_height(0),
-    m_stride(0),
-    m_pts(DVD_NOPTS_VALUE)
+    m_format(V4L2_PIX_FMT_RGB32),
+    m_planes(0),
+    m_pts(DVD_NOPTS_VALUE),
+    m_decoderPts(0),
+    m_captureTime(0)
   {
+    memzero(m_pitch);
+    memzero(m_offset);
   }
 
-  bool Create(int width, int height)
+  ~VideoFrame()
   {
-    m_width = width;//ALIGN(width, 32);
-    m_height = height;//ALIGN(height, 16);
-    m_stride = ALIGN(width, 16);
-    size_t len = ALIGN(height, 16) * (ALIGN(width, 32)) *4; //+ ALIGN(m_stride / 2, 16));
-    return m_ionBuffer.Allocate(len);
+    IonBufferPool::GetInstance().Release(m_ionBuffer);
+  }
+
+  // packed RGB32 is a single plane. NV12/NV21 have the luma plane followed
+  // by one interleaved chroma plane of half the height, same pitch.
+  static bool IsPlanar(uint32_t format)
+  {
+    return format == V4L2_PIX_FMT_NV12 || format == V4L2_PIX_FMT_NV21;
   }
 
-  const IonBuffer &GetBuffer() const { return m_ionBuffer; }
+  static int GetPitch(int width, uint32_t format)
+  {
+    return IsPlanar(format) ? ALIGN(width, 32) : ALIGN(width, 32) * 4;
+  }
+
+  static size_t GetAllocSize(int width, int height, uint32_t format)
+  {
+    size_t luma = ALIGN(height, 16) * GetPitch(width, format);
+    return IsPlanar(format) ? luma + luma / 2 : luma;
+  }
+
+  bool Create(int width, int height, uint32_t format)
+  {
+    SetGeometry(width, height, format);
+    m_ionBuffer = IonBufferPool::GetInstance().Acquire(GetAllocSize(width, height, format));
+    return m_ionBuffer != nullptr;
+  }
+
+  // lays out another size in the buffer it has, false when it does not fit
+  bool Resize(int width, int height, uint32_t format)
+  {
+    if (!m_ionBuffer || GetAllocSize(width, height, format) > m_ionBuffer->GetLength())
+      return false;
+    SetGeometry(width, height, format);
+    return true;
+  }
+
+  const IonBuffer &GetBuffer() const { return *m_ionBuffer; }
   int GetIndex() const               { return m_index; }
   int GetWidth() const               { return m_width; }
   int GetHeight() const              { return m_height; }
-  int GetStride() const              { return m_stride; }
+  uint32_t GetFormat() const         { return m_format; }
+  int GetPlanes() const              { return m_planes; }
+  int GetPitch(int plane) const      { return m_pitch[plane]; }
+  size_t GetOffset(int plane) const  { return m_offset[plane]; }
   double GetPts() const              { return m_pts; }
   void SetPts(double pts)            { m_pts = pts; }
+  // the pts ionvideo passed along, as checked in with the packet
+  int64_t GetDecoderPts() const      { return m_decoderPts; }
+  void SetDecoderPts(int64_t pts)    { m_decoderPts = pts; }
+  // CLOCK_MONOTONIC usec when the frame was dequeued from ionvideo
+  int64_t GetCaptureTime() const     { return m_captureTime; }
+  void SetCaptureTime(int64_t time)  { m_captureTime = time; }
 
 private:
-  IonBuffer m_ionBuffer;
+  void SetGeometry(int width, int height, uint32_t format)
+  {
+    m_width = width;//ALIGN(width, 32);
+    m_height = height;//ALIGN(height, 16);
+    m_format = format;
+    m_planes = IsPlanar(format) ? 2 : 1;
+    m_pitch[0] = m_pitch[1] = GetPitch(width, format);
+    m_offset[0] = 0;
+    m_offset[1] = IsPlanar(format) ? ALIGN(height, 16) * m_pitch[0] : 0;
+  }
+
+  IonBufferPtr m_ionBuffer;
   int       m_index;
   int       m_width;
   int       m_height;
-  int       m_stride;
+  uint32_t  m_format;       // V4L2 fourcc
+  int       m_planes;
+  int       m_pitch[2];
+  size_t    m_offset[2];
   double    m_pts;
+  int64_t   m_decoderPts;
+  int64_t   m_captureTime;
 };
 
 /***********************************************************/
 
+static int64_t monotonic_usec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// sysfs writes reconfigure the driver even when the value stays the same,
+// only write what differs.
+static void sysfs_set_int_changed(const std::string &path, int value)
+{
+  std::string current;
+  if (SysfsUtils::GetString(path, current) == 0 && !current.empty() &&
+      strtol(current.c_str(), NULL, 10) == value)
+    return;
+
+  SysfsUtils::SetInt(path, value);
+}
+
+// true when the default vfm path already is "decoder ionvideo", the map
+// lists it as "default { decoder(1) ionvideo(0)}" with use counts.
+static bool vfm_map_is_ionvideo()
+{
+  std::string map;
+  if (SysfsUtils::GetString("/sys/class/vfm/map", map) != 0)
+    return false;
+
+  size_t start = map.find("default {");
+  if (start == std::string::npos)
+    return false;
+  start += 9;
+  size_t end = map.find('}', start);
+  if (end == std::string::npos)
+    return false;
+
+  std::string path;
+  bool count = false;
+  for (size_t i = start; i < end; i++)
+  {
+    if (map[i] == '(')
+      count = true;
+    else if (map[i] == ')')
+      count = false;
+    else if (!count && map[i] != '\n')
+      path += map[i];
+  }
+  size_t first = path.find_first_not_of(' ');
+  size_t last = path.find_last_not_of(' ');
+  return first != std::string::npos && path.substr(first, last - first + 1) == "decoder ionvideo";
+}
+
+// tsync and the default vfm path are global to the box. open sessions
+// share them through this owner, the first one in sets them up and the
+// last one out turns tsync back on.
+class DecoderSysfsConfig
+{
+public:
+  static DecoderSysfsConfig &GetInstance()
+  {
+    static DecoderSysfsConfig config;
+    return config;
+  }
+
+  void Acquire()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_users++ > 0)
+      return;
+
+    // disable tsync, we are playing video disconnected from audio.
+    sysfs_set_int_changed("/sys/class/tsync/enable", 0);
+    if (!vfm_map_is_ionvideo())
+    {
+      SysfsUtils::SetString("/sys/class/vfm/map", "rm default");
+      SysfsUtils::SetString("/sys/class/vfm/map", "add default decoder ionvideo");
+    }
+  }
+
+  void Release()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_users > 0 && --m_users == 0)
+      sysfs_set_int_changed("/sys/class/tsync/enable", 1);
+  }
+
+private:
+  DecoderSysfsConfig() : m_users(0) {}
+
+  std::mutex m_mutex;
+  int        m_users;
+};
+
+// vdec/core lists the loaded decoders, one line per amvdec_* module on
+// 3.14 kernels and per vdec.* instance on later ones. -1 without the node.
+static int vdec_instances()
+{
+  std::string core;
+  if (SysfsUtils::GetString("/sys/class/vdec/core", core) != 0)
+    return -1;
+
+  int count = 0;
+  size_t start = 0;
+  while (start < core.size())
+  {
+    size_t end = core.find('\n', start);
+    if (end == std::string::npos)
+      end = core.size();
+    std::string line = core.substr(start, end - start);
+    if (line.find("amvdec_") != std::string::npos || line.find("vdec.") != std::string::npos)
+      count++;
+    start = end + 1;
+  }
+  return count;
+}
+
+// amvdec unloads asynchronously after codec_close, a codec_init before it
+// is gone fails or gets no output. busy is the instance count before the
+// close, other sessions keep theirs so only this one has to go away.
+// without vdec/core there is nothing to poll and the whole timeout is waited.
+static int vdec_wait_idle(int busy, int timeout)
+{
+  int64_t start = monotonic_usec();
+  int64_t elapsed = 0;
+
+  while (elapsed < timeout * 1000)
+  {
+    int count = vdec_instances();
+    if (count >= 0 && (count < busy || count == 0))
+      break;
+    usleep(CLOSE_IDLE_POLL * 1000);
+    elapsed = monotonic_usec() - start;
+  }
+
+  return elapsed / 1000;
+}
+
 static vformat_t codecid_to_vformat(enum AVCodecID id)
 {
   vformat_t format;
@@ -382,10 +675,9 @@ void am_packet_release(am_packet_t *pkt)
 int check_in_pts(am_private_t *para, am_packet_t *pkt)
 {
     int last_duration = 0;
-    static int last_v_duration = 0;
     int64_t pts = 0;
 
-    last_duration = last_v_duration;
+    last_duration = para->last_v_duration;
 
     if (para->stream_type == AM_STREAM_ES) {
         if ((int64_t)AV_NOPTS_VALUE != pkt->avpts) {
@@ -404,7 +696,7 @@ int check_in_pts(am_private_t *para, am_packet_t *pkt)
                 return PLAYER_PTS_ERROR;
             }
 
-            last_v_duration = pkt->avduration ? pkt->avduration : 1;
+            para->last_v_duration = pkt->avduration ? pkt->avduration : 1;
         } else {
             if (!para->check_first_pts) {
                 if (codec_checkin_pts(pkt->codec, 0) != 0) {
@@ -423,6 +715,27 @@ int check_in_pts(am_private_t *para, am_packet_t *pkt)
     return PLAYER_SUCCESS;
 }
 
+// waits up to RW_WAIT_TIME for the stream buffer to take data again. a
+// driver without poll support reports writable at once, back off a little
+// then so a retry on EAGAIN never spins.
+static void codec_wait_writable(codec_para_t *codec)
+{
+    struct pollfd p;
+    struct timespec start, end;
+
+    p.fd = codec->handle;
+    p.events = POLLOUT;
+    p.revents = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret = poll(&p, 1, RW_WAIT_TIME);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    int64_t waited = (int64_t)(end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    if (ret != 0 && waited < RW_SPIN_TIME)
+        usleep(RW_BACKOFF_TIME);
+}
+
 static int write_header(am_private_t *para, am_packet_t *pkt)
 {
     int write_bytes = 0, len = 0;
@@ -439,6 +752,7 @@ static int write_header(am_private_t *para, am_packet_t *pkt)
                     CLog::Log(LOGERROR, "%s::%s ERROR:write header failed!", CLASSNAME, __func__);
                     return PLAYER_WR_FAILED;
                 } else {
+                    codec_wait_writable(pkt->codec);
                     continue;
                 }
             } else {
@@ -493,12 +807,13 @@ int write_av_packet(am_private_t *para, am_packet_t *pkt)
                 return PLAYER_WR_FAILED;
             } else {
                 // adjust for any data we already wrote into codec.
-                // we sleep a bit then exit as we will get called again
-                // with the same pkt because pkt->isvalid has not been cleared.
+                // we wait for the stream buffer to drain then exit as we will
+                // get called again with the same pkt because pkt->isvalid has
+                // not been cleared.
                 pkt->data += len;
                 pkt->data_size -= len;
-                usleep(RW_WAIT_TIME);
-                CLog::Log(LOGDEBUG, "%s::%s usleep(RW_WAIT_TIME), len(%d)", CLASSNAME, __func__, len);
+                codec_wait_writable(pkt->codec);
+                CLog::Log(LOGDEBUG, "%s::%s codec_wait_writable, len(%d)", CLASSNAME, __func__, len);
                 return PLAYER_SUCCESS;
             }
         } else {
@@ -522,65 +837,31 @@ int write_av_packet(am_private_t *para, am_packet_t *pkt)
     return PLAYER_SUCCESS;
 }
 
-static int h264_add_header(unsigned char *buf, int size, am_packet_t *pkt)
+static int set_header(hdr_buf_t *hdr, int size)
 {
-    if (size > HDR_BUF_SIZE)
-    {
-        free(pkt->hdr->data);
-        pkt->hdr->data = (char *)malloc(size);
-        if (!pkt->hdr->data)
-            return PLAYER_NOMEM;
-    }
-
-    memcpy(pkt->hdr->data, buf, size);
-    pkt->hdr->size = size;
-    return PLAYER_SUCCESS;
-}
-
-static int h264_write_header(am_private_t *para, am_packet_t *pkt)
-{
-    CLog::Log(LOGDEBUG, "%s::%s h264_write_header", CLASSNAME, __func__);
-
-    int ret = h264_add_header(para->extradata, para->extrasize, pkt);
-    if (ret == PLAYER_SUCCESS) {
-        pkt->codec = &para->vcodec;
-        pkt->newflag = 1;
-        ret = write_av_packet(para, pkt);
-    }
-    return ret;
-}
-
-static int hevc_add_header(unsigned char *buf, int size,  am_packet_t *pkt)
-{
-    if (size > HDR_BUF_SIZE)
-    {
-        free(pkt->hdr->data);
-        pkt->hdr->data = (char *)malloc(size);
-        if (!pkt->hdr->data)
-            return PLAYER_NOMEM;
+    // sized for the stream, extradata of any length fits
+    char *data = (char *)realloc(hdr->data, size);
+    if (!data) {
+        CLog::Log(LOGERROR, "%s::%s NOMEM!", CLASSNAME, __func__);
+        return PLAYER_NOMEM;
     }
-
-    memcpy(pkt->hdr->data, buf, size);
-    pkt->hdr->size = size;
+    hdr->data = data;
+    hdr->size = size;
     return PLAYER_SUCCESS;
 }
 
-static int hevc_write_header(am_private_t *para, am_packet_t *pkt)
+static int copy_header(hdr_buf_t *hdr, unsigned char *buf, int size)
 {
-    int ret = -1;
+    if (!buf || size <= 0)
+        return PLAYER_SUCCESS;
 
-    if (para->extradata) {
-      ret = hevc_add_header(para->extradata, para->extrasize, pkt);
-    }
-    if (ret == PLAYER_SUCCESS) {
-      pkt->codec = &para->vcodec;
-      pkt->newflag = 1;
-      ret = write_av_packet(para, pkt);
-    }
+    int ret = set_header(hdr, size);
+    if (ret == PLAYER_SUCCESS)
+        memcpy(hdr->data, buf, size);
     return ret;
 }
 
-static int divx3_data_prefeeding(am_packet_t *pkt, unsigned w, unsigned h)
+static int divx3_build_header(hdr_buf_t *hdr, unsigned w, unsigned h)
 {
     unsigned i = (w << 12) | (h & 0xfff);
     unsigned char divx311_add[10] = {
@@ -592,64 +873,11 @@ static int divx3_data_prefeeding(am_packet_t *pkt, unsigned w, unsigned h)
     divx311_add[6] = (i >> 8) & 0xff;
     divx311_add[7] = i & 0xff;
 
-    if (pkt->hdr->data) {
-        memcpy(pkt->hdr->data, divx311_add, sizeof(divx311_add));
-        pkt->hdr->size = sizeof(divx311_add);
-    } else {
-        CLog::Log(LOGERROR, "%s::%s [divx3_data_prefeeding]No enough memory!", CLASSNAME, __func__);
-        return PLAYER_FAILED;
-    }
-    return PLAYER_SUCCESS;
+    return copy_header(hdr, divx311_add, sizeof(divx311_add));
 }
 
-static int divx3_write_header(am_private_t *para, am_packet_t *pkt)
+static int mpeg_build_header(hdr_buf_t *hdr, unsigned char *extradata, int extrasize)
 {
-    CLog::Log(LOGDEBUG, "%s::%s divx3_write_header", CLASSNAME, __func__);
-
-    divx3_data_prefeeding(pkt, para->video_width, para->video_height);
-
-    pkt->codec = &para->vcodec;
-    pkt->newflag = 1;
-    write_av_packet(para, pkt);
-    return PLAYER_SUCCESS;
-}
-
-static int m4s2_dx50_mp4v_add_header(unsigned char *buf, int size,  am_packet_t *pkt)
-{
-    if (size > pkt->hdr->size) {
-        free(pkt->hdr->data), pkt->hdr->data = NULL;
-        pkt->hdr->size = 0;
-
-        pkt->hdr->data = (char*)malloc(size);
-        if (!pkt->hdr->data) {
-            CLog::Log(LOGERROR, "%s::%s [m4s2_dx50_add_header] NOMEM!", CLASSNAME, __func__);
-            return PLAYER_FAILED;
-        }
-    }
-
-    pkt->hdr->size = size;
-    memcpy(pkt->hdr->data, buf, size);
-
-    return PLAYER_SUCCESS;
-}
-
-static int m4s2_dx50_mp4v_write_header(am_private_t *para, am_packet_t *pkt)
-{
-    CLog::Log(LOGDEBUG, "%s::%s m4s2_dx50_mp4v_write_header", CLASSNAME, __func__);
-
-    int ret = m4s2_dx50_mp4v_add_header(para->extradata, para->extrasize, pkt);
-    if (ret == PLAYER_SUCCESS) {
-        pkt->codec = &para->vcodec;
-        pkt->newflag = 1;
-        ret = write_av_packet(para, pkt);
-    }
-    return ret;
-}
-
-static int mpeg_add_header(am_private_t *para, am_packet_t *pkt)
-{
-    CLog::Log(LOGDEBUG, "%s::%s mpeg_add_header", CLASSNAME, __func__);
-
 #define STUFF_BYTES_LENGTH     (256)
 
     int size;
@@ -662,89 +890,108 @@ static int mpeg_add_header(am_private_t *para, am_packet_t *pkt)
         0xff, 0xff, 0xff, 0xff, 0xff, 0xff
     };
 
-    size = para->extrasize + sizeof(packet_wrapper);
+    int ret = set_header(hdr, sizeof(packet_wrapper) + extrasize + STUFF_BYTES_LENGTH);
+    if (ret != PLAYER_SUCCESS)
+        return ret;
+
+    size = extrasize + sizeof(packet_wrapper);
     packet_wrapper[4] = size >> 8 ;
     packet_wrapper[5] = size & 0xff ;
-    memcpy(pkt->hdr->data, packet_wrapper, sizeof(packet_wrapper));
+    memcpy(hdr->data, packet_wrapper, sizeof(packet_wrapper));
     size = sizeof(packet_wrapper);
-    //CLog::Log(LOGDEBUG, "[mpeg_add_header:%d]wrapper size=%d\n",__LINE__,size);
-    memcpy(pkt->hdr->data + size, para->extradata, para->extrasize);
-    size += para->extrasize;
-    //CLog::Log(LOGDEBUG, "[mpeg_add_header:%d]wrapper+seq size=%d\n",__LINE__,size);
-    memset(pkt->hdr->data + size, 0xff, STUFF_BYTES_LENGTH);
-    size += STUFF_BYTES_LENGTH;
-    pkt->hdr->size = size;
-    //CLog::Log(LOGDEBUG, "[mpeg_add_header:%d]hdr_size=%d\n",__LINE__,size);
-
-    pkt->codec = &para->vcodec;
-    pkt->newflag = 1;
-    return write_av_packet(para, pkt);
+    memcpy(hdr->data + size, extradata, extrasize);
+    size += extrasize;
+    memset(hdr->data + size, 0xff, STUFF_BYTES_LENGTH);
 
+    return PLAYER_SUCCESS;
 }
 
-int pre_header_feeding(am_private_t *para, am_packet_t *pkt)
+// the codec specific header goes in front of the stream after every open
+// and reset. it only depends on the stream, build it once per session.
+int build_header(am_private_t *para)
 {
-    int ret;
-
-    if (pkt->hdr == NULL) {
-        pkt->hdr = (hdr_buf_t*)malloc(sizeof(hdr_buf_t));
-        pkt->hdr->data = (char*)malloc(HDR_BUF_SIZE);
-        if (!pkt->hdr->data) {
-            CLog::Log(LOGERROR, "%s::%s [pre_header_feeding] NOMEM!", CLASSNAME, __func__);
-            return PLAYER_NOMEM;
-        }
+    hdr_buf_t *hdr = &para->header;
+    hdr->size = 0;
+
+    if (para->stream_type != AM_STREAM_ES)
+        return PLAYER_SUCCESS;
+
+    if (VFORMAT_H264 == para->video_format || VFORMAT_H264_4K2K == para->video_format
+            || VFORMAT_HEVC == para->video_format) {
+        return copy_header(hdr, para->extradata, para->extrasize);
+    } else if ((VFORMAT_MPEG4 == para->video_format) && (VIDEO_DEC_FORMAT_MPEG4_3 == para->video_codec_type)) {
+        return divx3_build_header(hdr, para->video_width, para->video_height);
+    } else if ((CODEC_TAG_M4S2 == para->video_codec_tag)
+            || (CODEC_TAG_DX50 == para->video_codec_tag)
+            || (CODEC_TAG_mp4v == para->video_codec_tag)) {
+        return copy_header(hdr, para->extradata, para->extrasize);
+    } else if (( AV_CODEC_ID_MPEG1VIDEO == para->video_codec_id)
+      || (AV_CODEC_ID_MPEG2VIDEO == para->video_codec_id)) {
+        return mpeg_build_header(hdr, para->extradata, para->extrasize);
     }
 
-    if (para->stream_type == AM_STREAM_ES) {
-        if (VFORMAT_H264 == para->video_format || VFORMAT_H264_4K2K == para->video_format) {
-            ret = h264_write_header(para, pkt);
-            if (ret != PLAYER_SUCCESS) {
-                return ret;
-            }
-        } else if (VFORMAT_HEVC == para->video_format) {
-            ret = hevc_write_header(para, pkt);
-            if (ret != PLAYER_SUCCESS) {
-                return ret;
-            }
-        } else if ((VFORMAT_MPEG4 == para->video_format) && (VIDEO_DEC_FORMAT_MPEG4_3 == para->video_codec_type)) {
-            ret = divx3_write_header(para, pkt);
-            if (ret != PLAYER_SUCCESS) {
-                return ret;
-            }
-        } else if ((CODEC_TAG_M4S2 == para->video_codec_tag)
-                || (CODEC_TAG_DX50 == para->video_codec_tag)
-                || (CODEC_TAG_mp4v == para->video_codec_tag)) {
-            ret = m4s2_dx50_mp4v_write_header(para, pkt);
-            if (ret != PLAYER_SUCCESS) {
-                return ret;
-            }
-        } else if (( AV_CODEC_ID_MPEG1VIDEO == para->video_codec_id)
-          || (AV_CODEC_ID_MPEG2VIDEO == para->video_codec_id)) {
-            ret = mpeg_add_header(para, pkt);
-            if (ret != PLAYER_SUCCESS) {
-                return ret;
-            }
-        }
-    }
+    return PLAYER_SUCCESS;
+}
 
-    if (pkt->hdr) {
-        if (pkt->hdr->data) {
-            free(pkt->hdr->data);
-            pkt->hdr->data = NULL;
-        }
-        free(pkt->hdr);
+void release_header(am_private_t *para)
+{
+    free(para->header.data);
+    para->header.data = NULL;
+    para->header.size = 0;
+}
+
+int pre_header_feeding(am_private_t *para, am_packet_t *pkt)
+{
+    int ret = PLAYER_SUCCESS;
+
+    if (para->header.size > 0) {
+        CLog::Log(LOGDEBUG, "%s::%s header size %d", CLASSNAME, __func__, para->header.size);
+        pkt->hdr = &para->header;
+        pkt->codec = &para->vcodec;
+        pkt->newflag = 1;
+        ret = write_av_packet(para, pkt);
+        // the cached header stays with the session, am_packet_release must not free it
         pkt->hdr = NULL;
     }
 
-    return PLAYER_SUCCESS;
+    return ret;
 }
 
-CLinuxC1Codec::CLinuxC1Codec() {
+CLinuxC1Codec::CLinuxC1Codec() :
+  m_threadsStop(true),
+  m_captureStop(true),
+  m_captureError(false),
+  m_driverFrames(0)
+{
   am_private = new am_private_t;
   memzero(*am_private);
+  m_dropState = false;
+  m_maxTemporalId = -1;
+  m_noblock = true;
+  m_captureFormat = V4L2_PIX_FMT_RGB32;
+  m_device = ION_VIDEO_DEVICE;
+  m_bufferLow = BUFFER_DEFAULT_LOW;
+  m_bufferHigh = BUFFER_DEFAULT_HIGH;
+  m_bufferFull = false;
+  m_queuedBytes = 0;
+  m_sysfsAcquired = false;
+  m_outputWidth = 0;
+  m_outputHeight = 0;
+  m_captureWidth = 0;
+  m_captureHeight = 0;
+  m_reorderDepth = CAPTURE_DEFAULT_REORDER;
+  m_consumerHold = CAPTURE_DEFAULT_HOLD;
+  m_captureBudget = CAPTURE_DEFAULT_BUDGET;
+  m_lastCaptureTime = 0;
+  m_streamWidth = 0;
+  m_streamHeight = 0;
+  m_resizePending = false;
+  m_resizeTime = 0;
 }
 
 CLinuxC1Codec::~CLinuxC1Codec() {
+  StopThreads();
+  release_header(am_private);
   delete am_private;
   am_private = NULL;
 }
@@ -760,6 +1007,19 @@ bool CLinuxC1Codec::OpenDecoder(CDVDStreamInfo &hints) {
   m_start_dts = 0;
   m_start_pts = 0;
   m_hints = hints;
+  am_private->check_first_pts = 0;
+  am_private->last_v_duration = 0;
+
+  m_picOrder = CPicOrderParser();
+  m_picOrder.ParseExtraData(hints.codec, (const uint8_t*)hints.extradata, hints.extrasize);
+  m_ptsQueue.clear();
+  m_ptsOrder = 0;
+  m_lastPts = DVD_NOPTS_VALUE;
+  m_lastInputPts = DVD_NOPTS_VALUE;
+  m_bufferFull = false;
+  m_frameDuration = 0.0;
+  if (hints.fpsrate > 0 && hints.fpsscale > 0)
+    m_frameDuration = (double)DVD_TIME_BASE * hints.fpsscale / hints.fpsrate;
 
   m_lastFrame = nullptr;
   m_dropState = false;
@@ -861,7 +1121,7 @@ bool CLinuxC1Codec::OpenDecoder(CDVDStreamInfo &hints) {
     CLASSNAME, __func__, hints.orientation, hints.forced_aspect, hints.extrasize);
 
   // default video codec params
-  am_private->gcodec.noblock     = 0;
+  am_private->gcodec.noblock     = m_noblock;
   am_private->gcodec.video_pid   = am_private->video_pid;
   am_private->gcodec.video_type  = am_private->video_format;
   am_private->gcodec.stream_type = STREAM_TYPE_ES_VIDEO;
@@ -907,6 +1167,13 @@ bool CLinuxC1Codec::OpenDecoder(CDVDStreamInfo &hints) {
   // translate from generic to firmware version dependent
   codec_init_para(&am_private->gcodec, &am_private->vcodec);
 
+  // written again from the cache on every reset
+  if (build_header(am_private) != PLAYER_SUCCESS)
+  {
+    CloseIonVideo();
+    return false;
+  }
+
   int ret = codec_init(&am_private->vcodec);
   if (ret != CODEC_ERROR_NONE)
   {
@@ -921,94 +1188,306 @@ bool CLinuxC1Codec::OpenDecoder(CDVDStreamInfo &hints) {
 
   codec_set_cntl_avthresh(&am_private->vcodec, AV_SYNC_THRESH);
   codec_set_cntl_syncthresh(&am_private->vcodec, 0);
-  // disable tsync, we are playing video disconnected from audio.
-  SysfsUtils::SetInt("/sys/class/tsync/enable", 0);
 
   am_private->am_pkt.codec = &am_private->vcodec;
   pre_header_feeding(am_private, &am_private->am_pkt);
 
   SetSpeed(m_speed);
+  StartThreads();
 
   return true;
 }
 
 bool CLinuxC1Codec::OpenIonVideo(const CDVDStreamInfo &hints)
 {
-  PosixFilePtr ionFile = std::make_shared<PosixFile>();
-  if (!ionFile->Open("/dev/ion", O_RDWR))
+  PosixFilePtr ionVideoFile = std::make_shared<PosixFile>();
+  if (!ionVideoFile->Open(m_device.c_str(), O_RDWR | O_NONBLOCK))
   {
-    CLog::Log(LOGERROR, "CLinuxC1Codec::OpenIonVideo - cannot open ION memory management device /dev/ion: %s", strerror(errno));
+    CLog::Log(LOGERROR, "CLinuxC1Codec::OpenIonVideo - cannot open ION video device %s: %s", m_device.c_str(), strerror(errno));
     return false;
   }
 
-  PosixFilePtr ionVideoFile = std::make_shared<PosixFile>();
-  if (!ionVideoFile->Open("/dev/video13", O_RDWR | O_NONBLOCK))
+  m_ionVideoFile = ionVideoFile;
+  if (!SetCaptureSize(hints))
   {
-    CLog::Log(LOGERROR, "CLinuxC1Codec::OpenIonVideo - cannot open ION video device /dev/video13: %s", strerror(errno));
+    m_ionVideoFile.reset();
     return false;
   }
 
+  if (!RequestFrames(GetCaptureFrameCount()))
+  {
+    CloseIonVideo();
+    return false;
+  }
+
+  DecoderSysfsConfig::GetInstance().Acquire();
+  m_sysfsAcquired = true;
+  SetScalingRate(hints);
+
+  return true;
+}
+
+bool CLinuxC1Codec::SetCaptureSize(const CDVDStreamInfo &hints)
+{
+  int width, height;
+  GetCaptureSize(hints, &width, &height);
+
   v4l2_format fmt = { 0 };
   fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  fmt.fmt.pix_mp.width = hints.width;
-  fmt.fmt.pix_mp.height = hints.height;
-  fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_RGB32;
-  if (ionVideoFile->IOControl(VIDIOC_S_FMT, &fmt) < 0)
+  fmt.fmt.pix.width = width;
+  fmt.fmt.pix.height = height;
+  fmt.fmt.pix.pixelformat = m_captureFormat;
+  if (m_ionVideoFile->IOControl(VIDIOC_S_FMT, &fmt) < 0)
   {
-    CLog::Log(LOGERROR, "CLinuxC1Codec::OpenIonVideo - VIDIOC_S_FMT failed: %s", strerror(errno));
+    CLog::Log(LOGERROR, "CLinuxC1Codec::SetCaptureSize - VIDIOC_S_FMT failed: %s", strerror(errno));
     return false;
   }
 
+  // the driver may round the size, frames are allocated for what it took
+  m_captureWidth = fmt.fmt.pix.width ? (int)fmt.fmt.pix.width : width;
+  m_captureHeight = fmt.fmt.pix.height ? (int)fmt.fmt.pix.height : height;
+  if (m_captureWidth != hints.width || m_captureHeight != hints.height)
+    CLog::Log(LOGNOTICE, "%s::%s scaling %dx%d to %dx%d", CLASSNAME, __func__,
+      hints.width, hints.height, m_captureWidth, m_captureHeight);
+
+  return true;
+}
+
+void CLinuxC1Codec::SetScalingRate(const CDVDStreamInfo &hints)
+{
+  // percent of the decoded size ppmgr scales to, rounded up so the
+  // picture never ends up smaller than the buffers
+  int rate = (m_captureWidth * 100 + hints.width - 1) / hints.width;
+  sysfs_set_int_changed("/sys/class/ionvideo/scaling_rate", std::min(std::max(rate, 1), 100));
+}
+
+void CLinuxC1Codec::GetCaptureSize(const CDVDStreamInfo &hints, int *width, int *height) const
+{
+  *width = hints.width;
+  *height = hints.height;
+  if (m_outputWidth <= 0 || m_outputHeight <= 0)
+    return;
+
+  // only ever scale down, upscaling is left to the GPU
+  double scale = std::min((double)m_outputWidth / hints.width, (double)m_outputHeight / hints.height);
+  if (scale >= 1.0)
+    return;
+
+  // ppmgr works on even sizes
+  *width = std::max((int)(hints.width * scale) & ~1, 2);
+  *height = std::max((int)(hints.height * scale) & ~1, 2);
+}
+
+int CLinuxC1Codec::GetCaptureFrameCount() const
+{
+  // one frame for the decoder to write, the ones the consumer holds and
+  // a reorder burst worth of output, as far as the carveout budget allows.
+  size_t frameSize = VideoFrame::GetAllocSize(m_captureWidth, m_captureHeight, m_captureFormat);
+  int count = m_reorderDepth + m_consumerHold + 1;
+  int budget = frameSize ? m_captureBudget / frameSize : CAPTURE_MAX_FRAMES;
+
+  if (count > budget)
+  {
+    CLog::Log(LOGDEBUG, "%s::%s %d frames of %d bytes exceed the budget of %d bytes",
+      CLASSNAME, __func__, count, (int)frameSize, (int)m_captureBudget);
+    count = budget;
+  }
+
+  return std::min(std::max(count, CAPTURE_MIN_FRAMES), CAPTURE_MAX_FRAMES);
+}
+
+bool CLinuxC1Codec::RequestFrames(int count)
+{
   v4l2_requestbuffers req = { 0 };
-  req.count = 4;
+  req.count = count;
   req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   req.memory = V4L2_MEMORY_DMABUF;
-  if (ionVideoFile->IOControl(VIDIOC_REQBUFS, &req) < 0)
+  if (m_ionVideoFile->IOControl(VIDIOC_REQBUFS, &req) < 0)
   {
-    CLog::Log(LOGERROR, "CLinuxC1Codec::OpenIonVideo - VIDIOC_REQBUFS failed: %s", strerror(errno));
+    CLog::Log(LOGERROR, "CLinuxC1Codec::RequestFrames - VIDIOC_REQBUFS failed: %s", strerror(errno));
     return false;
   }
 
   int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  if (ionVideoFile->IOControl(VIDIOC_STREAMON, &type) < 0)
+  if (m_ionVideoFile->IOControl(VIDIOC_STREAMON, &type) < 0)
   {
-      CLog::Log(LOGERROR, "CLinuxC1Codec::OpenIonVideo - VIDIOC_STREAMON failed: %s", strerror(errno));
-      return false;
+    CLog::Log(LOGERROR, "CLinuxC1Codec::RequestFrames - VIDIOC_STREAMON failed: %s", strerror(errno));
+    return false;
   }
 
-  m_ionFile = ionFile;
-  m_ionVideoFile = ionVideoFile;
-
+  // the driver may grant another count. frames of the previous pool are
+  // kept under their index when their buffer fits the capture size, except
+  // the ones still holding a picture for the consumer
+  std::vector<VideoFramePtr> videoFrames;
   for (size_t i = 0; i < req.count; ++i)
   {
-    CLog::Log(LOGNOTICE, "CLinuxC1Codec::OpenIonVideo - creating a video frame (width = %d, height = %d)", hints.width, hints.height);
-    VideoFramePtr videoFrame = std::make_shared<VideoFrame>(ionFile, i);
-    if (!videoFrame->Create(hints.width, hints.height))
+    if (i < m_videoFrames.size() && m_videoFrames[i] != m_lastFrame &&
+        std::find(m_readyFrames.begin(), m_readyFrames.end(), m_videoFrames[i]) == m_readyFrames.end() &&
+        m_videoFrames[i]->Resize(m_captureWidth, m_captureHeight, m_captureFormat))
     {
-      CLog::Log(LOGERROR, "CLinuxC1Codec::OpenIonVideo - cannot create a video frame (width = %d, height = %d)", hints.width, hints.height);
-      CloseIonVideo();
-      return false;
+      videoFrames.push_back(m_videoFrames[i]);
+      continue;
     }
 
-    m_videoFrames.push_back(videoFrame);
-
-    if (!QueueFrame(videoFrame))
+    CLog::Log(LOGNOTICE, "CLinuxC1Codec::RequestFrames - creating a video frame (width = %d, height = %d)", m_captureWidth, m_captureHeight);
+    VideoFramePtr videoFrame = std::make_shared<VideoFrame>(i);
+    if (!videoFrame->Create(m_captureWidth, m_captureHeight, m_captureFormat))
     {
-      CloseIonVideo();
+      CLog::Log(LOGERROR, "CLinuxC1Codec::RequestFrames - cannot create a video frame (width = %d, height = %d)", m_captureWidth, m_captureHeight);
       return false;
     }
+    videoFrames.push_back(videoFrame);
+  }
+  m_videoFrames.swap(videoFrames);
+
+  for (size_t i = 0; i < m_videoFrames.size(); ++i)
+  {
+    if (!QueueFrame(m_videoFrames[i]))
+      return false;
+  }
+
+  CLog::Log(LOGDEBUG, "%s::%s %d capture frames", CLASSNAME, __func__, (int)m_videoFrames.size());
+  return true;
+}
+
+bool CLinuxC1Codec::ReconfigureCapture()
+{
+  // before OpenDecoder the pool is sized when it is created
+  if (!m_ionVideoFile)
+    return true;
+
+  int count = GetCaptureFrameCount();
+  if (count == (int)m_videoFrames.size())
+    return true;
+
+  CLog::Log(LOGNOTICE, "%s::%s capture frames %d -> %d", CLASSNAME, __func__, (int)m_videoFrames.size(), count);
+
+  // streamoff hands every buffer back, pictures already dequeued stay in
+  // m_readyFrames with their frames
+  bool running = !m_threadsStop;
+  StopCapture();
+
+  int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (m_ionVideoFile->IOControl(VIDIOC_STREAMOFF, &type) < 0)
+    CLog::Log(LOGERROR, "CLinuxC1Codec::ReconfigureCapture - VIDIOC_STREAMOFF failed: %s", strerror(errno));
+  {
+    std::lock_guard<std::mutex> lock(m_queueMutex);
+    m_driverFrames = 0;
   }
 
-  SysfsUtils::SetString("/sys/class/vfm/map", "rm default");
-  SysfsUtils::SetString("/sys/class/vfm/map", "add default decoder ionvideo");
+  if (!RequestFrames(count))
+  {
+    m_captureError = true;
+    return false;
+  }
+
+  if (running)
+    StartCapture();
+  return true;
+}
+
+bool CLinuxC1Codec::UpdateStreamSize()
+{
+  int width, height;
+  {
+    std::lock_guard<std::mutex> lock(m_queueMutex);
+    if (!m_resizePending || m_packets.empty())
+      return true;
 
-  SysfsUtils::SetInt("/sys/class/ionvideo/scaling_rate", 100);
+    // the decoder may still hold pictures of the old sequence, it is
+    // drained once none came out for RESIZE_IDLE_TIME
+    if (monotonic_usec() - std::max(m_resizeTime, m_lastCaptureTime) < RESIZE_IDLE_TIME * 1000)
+      return true;
+
+    width = m_packets.front().width;
+    height = m_packets.front().height;
+  }
+
+  CLog::Log(LOGNOTICE, "%s::%s stream size %dx%d -> %dx%d", CLASSNAME, __func__,
+    m_hints.width, m_hints.height, width, height);
+
+  // streamoff hands every buffer back, pictures already dequeued stay in
+  // m_readyFrames with their frames
+  StopCapture();
+
+  int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (m_ionVideoFile->IOControl(VIDIOC_STREAMOFF, &type) < 0)
+    CLog::Log(LOGERROR, "CLinuxC1Codec::UpdateStreamSize - VIDIOC_STREAMOFF failed: %s", strerror(errno));
+
+  // the format only changes without buffers, frames that fit the new
+  // size are handed back to the driver by RequestFrames
+  v4l2_requestbuffers req = { 0 };
+  req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  req.memory = V4L2_MEMORY_DMABUF;
+  if (m_ionVideoFile->IOControl(VIDIOC_REQBUFS, &req) < 0)
+    CLog::Log(LOGERROR, "CLinuxC1Codec::UpdateStreamSize - VIDIOC_REQBUFS failed: %s", strerror(errno));
+  {
+    std::lock_guard<std::mutex> lock(m_queueMutex);
+    m_driverFrames = 0;
+  }
+
+  m_hints.width = width;
+  m_hints.height = height;
+  bool ok = SetCaptureSize(m_hints) && RequestFrames(GetCaptureFrameCount());
+  if (ok)
+  {
+    SetScalingRate(m_hints);
+    StartCapture();
+  }
+  else
+    m_captureError = true;
+
+  // the feeder goes on with the first packet of the new sequence
+  std::lock_guard<std::mutex> lock(m_queueMutex);
+  m_packets.front().width = m_packets.front().height = 0;
+  m_resizePending = false;
+  m_packetCond.notify_one();
+  return ok;
+}
+
+bool CLinuxC1Codec::SetReorderDepth(int frames)
+{
+  m_reorderDepth = std::max(frames, 0);
+  return ReconfigureCapture();
+}
+
+bool CLinuxC1Codec::SetConsumerHold(int frames)
+{
+  m_consumerHold = std::max(frames, 0);
+  return ReconfigureCapture();
+}
+
+bool CLinuxC1Codec::SetCaptureBudget(size_t bytes)
+{
+  m_captureBudget = bytes;
+  return ReconfigureCapture();
+}
+
+bool CLinuxC1Codec::SetCaptureFormat(uint32_t format)
+{
+  if (format != V4L2_PIX_FMT_RGB32 && !VideoFrame::IsPlanar(format))
+  {
+    CLog::Log(LOGERROR, "%s::%s unsupported capture format 0x%08x", CLASSNAME, __func__, format);
+    return false;
+  }
 
+  m_captureFormat = format;
   return true;
 }
 
+void CLinuxC1Codec::SetIonPoolCap(size_t bytes)
+{
+  IonBufferPool::GetInstance().SetCap(bytes);
+}
+
 bool CLinuxC1Codec::QueueFrame(VideoFramePtr frame)
 {
+  // a frame of a pool that was renegotiated since it was handed out is
+  // released with its last reference instead
+  size_t index = frame->GetIndex();
+  if (index >= m_videoFrames.size() || m_videoFrames[index] != frame)
+    return true;
+
   v4l2_buffer vbuf = { 0 };
   vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   vbuf.memory = V4L2_MEMORY_DMABUF;
@@ -1022,6 +1501,10 @@ bool CLinuxC1Codec::QueueFrame(VideoFramePtr frame)
     return false;
   }
 
+  std::lock_guard<std::mutex> lock(m_queueMutex);
+  m_driverFrames++;
+  m_frameCond.notify_one();
+
   return true;
 }
 
@@ -1044,8 +1527,18 @@ bool CLinuxC1Codec::DequeueFrame(VideoFramePtr &frame)
     }
   }
 
+  if (vbuf.index >= m_videoFrames.size())
+  {
+    CLog::Log(LOGERROR, "CLinuxC1Codec::DequeueFrame - VIDIOC_DQBUF returned unknown index %d", vbuf.index);
+    return false;
+  }
+
   frame = m_videoFrames[vbuf.index];
-  frame->SetPts((double)vbuf.timestamp.tv_usec/* / PTS_FREQ * DVD_TIME_BASE*/);
+  frame->SetDecoderPts((int64_t)vbuf.timestamp.tv_sec * 1000000 + vbuf.timestamp.tv_usec);
+  frame->SetCaptureTime(monotonic_usec());
+
+  std::lock_guard<std::mutex> lock(m_queueMutex);
+  m_driverFrames--;
 
   return true;
 }
@@ -1060,8 +1553,205 @@ void CLinuxC1Codec::CloseIonVideo()
   }
 
   m_videoFrames.clear();
-  m_ionFile.reset();
+  m_readyFrames.clear();
+  m_driverFrames = 0;
   m_ionVideoFile.reset();
+
+  if (m_sysfsAcquired)
+    DecoderSysfsConfig::GetInstance().Release();
+  m_sysfsAcquired = false;
+}
+
+void CLinuxC1Codec::StartThreads()
+{
+  // packets of a new sequence dropped before they were written never
+  // resized the capture, the next ones are compared to the current size
+  m_streamWidth = m_hints.width;
+  m_streamHeight = m_hints.height;
+  m_resizePending = false;
+
+  m_threadsStop = false;
+  m_captureError = false;
+  m_feederThread = std::thread(&CLinuxC1Codec::FeederThread, this);
+  StartCapture();
+}
+
+void CLinuxC1Codec::StartCapture()
+{
+  m_captureStop = false;
+  m_captureThread = std::thread(&CLinuxC1Codec::CaptureThread, this);
+}
+
+void CLinuxC1Codec::StopCapture()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_queueMutex);
+    m_captureStop = true;
+  }
+  m_frameCond.notify_all();
+
+  if (m_captureThread.joinable())
+    m_captureThread.join();
+}
+
+void CLinuxC1Codec::StopThreads()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_queueMutex);
+    m_threadsStop = true;
+  }
+  m_packetCond.notify_all();
+  m_spaceCond.notify_all();
+  m_frameCond.notify_all();
+  m_readyCond.notify_all();
+
+  if (m_feederThread.joinable())
+    m_feederThread.join();
+  if (m_captureThread.joinable())
+    m_captureThread.join();
+
+  // packets not written yet are dropped, their buffers kept for reuse
+  std::lock_guard<std::mutex> lock(m_queueMutex);
+  while (!m_packets.empty())
+  {
+    m_packets.front().data.clear();
+    m_freeBuffers.push_back(std::move(m_packets.front().data));
+    m_packets.pop_front();
+  }
+  m_queuedBytes = 0;
+}
+
+void CLinuxC1Codec::FeederThread()
+{
+  std::unique_lock<std::mutex> lock(m_queueMutex);
+  while (!m_threadsStop)
+  {
+    if (m_packets.empty())
+    {
+      m_packetCond.wait(lock);
+      continue;
+    }
+
+    // the pictures before a new sequence go out at the old size, nothing
+    // of it is written until the caller resized the capture side
+    if (m_packets.front().width)
+    {
+      if (!m_resizePending)
+      {
+        m_resizePending = true;
+        m_resizeTime = monotonic_usec();
+        m_readyCond.notify_all();
+      }
+      m_packetCond.wait(lock);
+      continue;
+    }
+
+    am_queued_packet_t packet = std::move(m_packets.front());
+    m_packets.pop_front();
+    m_queuedBytes -= packet.data.size();
+    lock.unlock();
+
+    am_private->am_pkt.data = packet.data.data();
+    am_private->am_pkt.data_size = packet.data.size();
+    am_private->am_pkt.avpts = packet.avpts;
+    am_private->am_pkt.avdts = packet.avdts;
+
+    am_private->am_pkt.newflag    = 1;
+    am_private->am_pkt.isvalid    = 1;
+    am_private->am_pkt.avduration = 0;
+
+    while (am_private->am_pkt.isvalid && !m_threadsStop)
+    {
+      // abort on any errors.
+      if (write_av_packet(am_private, &am_private->am_pkt) != PLAYER_SUCCESS)
+        break;
+
+      if (am_private->am_pkt.isvalid)
+        CLog::Log(LOGDEBUG, "%s::%s: write_av_packet looping", CLASSNAME, __func__);
+    }
+
+    // if we seek, then GetTimeSize is wrong as
+    // reports lastpts - cur_pts and hw decoder has
+    // not started outputing new pts values yet.
+    // so we grab the 1st pts sent into driver and
+    // use that to calc GetTimeSize.
+    if (m_1st_pts == 0)
+      m_1st_pts = am_private->am_pkt.lastpts;
+
+    lock.lock();
+    packet.data.clear();
+    m_freeBuffers.push_back(std::move(packet.data));
+    m_spaceCond.notify_one();
+  }
+}
+
+void CLinuxC1Codec::CaptureThread()
+{
+  while (!m_threadsStop && !m_captureStop)
+  {
+    {
+      // ionvideo reports POLLERR while it holds no buffer, wait for one
+      std::unique_lock<std::mutex> lock(m_queueMutex);
+      if (m_driverFrames <= 0)
+      {
+        m_frameCond.wait_for(lock, std::chrono::milliseconds(CAPTURE_POLL_TIME));
+        continue;
+      }
+    }
+
+    if (m_ionVideoFile->Poll(CAPTURE_POLL_TIME) <= 0)
+      continue;
+
+    // take every frame that is done, not only the one that woke us up
+    VideoFramePtr frame;
+    for (;;)
+    {
+      if (!DequeueFrame(frame))
+      {
+        m_captureError = true;
+        m_readyCond.notify_all();
+        return;
+      }
+      if (!frame)
+        break;
+
+      std::lock_guard<std::mutex> lock(m_queueMutex);
+      m_readyFrames.push_back(frame);
+      m_lastCaptureTime = frame->GetCaptureTime();
+      m_readyCond.notify_all();
+    }
+  }
+}
+
+int CLinuxC1Codec::WaitForPictures(int timeout)
+{
+  std::chrono::steady_clock::time_point deadline =
+    std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+  std::unique_lock<std::mutex> lock(m_queueMutex);
+  for (;;)
+  {
+    // no picture comes while the feeder waits for a resize, the wait is
+    // cut short to resize once the decoder went idle
+    bool resize = m_resizePending;
+    std::chrono::steady_clock::time_point until = deadline;
+    if (resize)
+      until = std::min(deadline, std::chrono::steady_clock::now() + std::chrono::milliseconds(RESIZE_IDLE_TIME));
+
+    if (m_readyCond.wait_until(lock, until,
+          [this] { return !m_readyFrames.empty() || m_captureError || m_threadsStop; }) || !resize)
+      break;
+
+    lock.unlock();
+    UpdateStreamSize();
+    lock.lock();
+    if (std::chrono::steady_clock::now() >= deadline)
+      break;
+  }
+
+  if (m_captureError)
+    return -1;
+  return m_readyFrames.size();
 }
 
 void CLinuxC1Codec::SetSpeed(int speed)
@@ -1098,36 +1788,55 @@ bool CLinuxC1Codec::GetPicture(DVDVideoPicture *pDvdVideoPicture)
   pDvdVideoPicture->pts = m_lastFrame->GetPts();
   pDvdVideoPicture->dts = DVD_NOPTS_VALUE;
 
-  pDvdVideoPicture->data[0] = (uint8_t*)m_lastFrame->GetBuffer().GetShareDescriptor();
-  pDvdVideoPicture->iLineSize[0] = (ALIGN(m_lastFrame->GetWidth(), 32)) * 4;
+  // bypass pictures carry dma-buf fds. data[0]/[1] are the fd of each
+  // plane, data[2]/[3] the plane offsets in it, iLineSize[0]/[1] the
+  // pitches and extended_format the V4L2 fourcc of the layout.
+  intptr_t fd = m_lastFrame->GetBuffer().GetShareDescriptor();
+  for (int i = 0; i < 2; i++)
+  {
+    bool plane = i < m_lastFrame->GetPlanes();
+    pDvdVideoPicture->data[i] = plane ? (uint8_t*)fd : NULL;
+    pDvdVideoPicture->data[i + 2] = plane ? (uint8_t*)(intptr_t)m_lastFrame->GetOffset(i) : NULL;
+    pDvdVideoPicture->iLineSize[i] = plane ? m_lastFrame->GetPitch(i) : 0;
+  }
+  pDvdVideoPicture->extended_format = m_lastFrame->GetFormat();
   pDvdVideoPicture->iIndex = m_lastFrame->GetIndex();
   pDvdVideoPicture->iWidth = m_lastFrame->GetWidth();
   pDvdVideoPicture->iHeight = m_lastFrame->GetHeight();
   pDvdVideoPicture->iDisplayWidth = pDvdVideoPicture->iWidth;
   pDvdVideoPicture->iDisplayHeight = pDvdVideoPicture->iHeight;
 
+  debug_log(LOGDEBUG, "%s::%s capture to picture latency %lld us", CLASSNAME, __func__,
+    (long long)(monotonic_usec() - m_lastFrame->GetCaptureTime()));
+
   return true;
 }
 
 void CLinuxC1Codec::CloseDecoder() {
   CLog::Log(LOGDEBUG, "%s::%s", CLASSNAME, __func__);
 
+  StopThreads();
+
   // never leave vcodec ff/rw or paused.
   if (m_speed != DVD_PLAYSPEED_NORMAL)
   {
     codec_resume(&am_private->vcodec);
     codec_set_cntl_mode(&am_private->vcodec, TRICKMODE_NONE);
   }
+
+  // decoders of other sessions stay loaded, wait for one less instance
+  int busy = vdec_instances();
   codec_close(&am_private->vcodec);
 
   am_packet_release(&am_private->am_pkt);
   free(am_private->extradata);
   am_private->extradata = NULL;
-  SysfsUtils::SetInt("/sys/class/tsync/enable", 1);
+  release_header(am_private);
 
   CloseIonVideo();
 
-  usleep(500 * 1000);
+  int waited = vdec_wait_idle(busy, CLOSE_IDLE_TIMEOUT);
+  CLog::Log(LOGDEBUG, "%s::%s decoder idle after %d ms", CLASSNAME, __func__, waited);
 }
 
 double CLinuxC1Codec::GetPlayerPtsSeconds()
@@ -1150,70 +1859,119 @@ int CLinuxC1Codec::Decode(uint8_t *pData, size_t iSize, double dts, double pts)
       return VC_ERROR;
   }
   m_lastFrame = nullptr;
+  UpdateStreamSize();
 
-  if (pData)
+  bool dropped = false;
+  if (pData && m_dropState && CBitstreamParser::IsNonReferencePicture(m_hints.codec, pData, iSize, m_maxTemporalId))
   {
-    am_private->am_pkt.data = pData;
-    am_private->am_pkt.data_size = iSize;
-
-    am_private->am_pkt.newflag    = 1;
-    am_private->am_pkt.isvalid    = 1;
-    am_private->am_pkt.avduration = 0;
+    // the player is late, nothing references this picture so it never
+    // reaches the decoder. frames already decoded are still handed out below.
+    dropped = true;
+  }
+  else if (pData)
+  {
+    am_queued_packet_t packet;
+
+    // ad splices and adaptive streams change the picture size mid stream,
+    // the packet starting the new sequence carries it to the feeder
+    int width, height;
+    packet.width = packet.height = 0;
+    if (CBitstreamParser::GetPictureSize(m_hints.codec, pData, iSize, &width, &height) &&
+        (width != m_streamWidth || height != m_streamHeight))
+    {
+      packet.width = m_streamWidth = width;
+      packet.height = m_streamHeight = height;
+    }
 
     // handle pts, including 31bit wrap, aml can only handle 31
     // bit pts as it uses an int in kernel.
     if (m_hints.ptsinvalid || pts == DVD_NOPTS_VALUE)
-      am_private->am_pkt.avpts = AV_NOPTS_VALUE;
+      packet.avpts = AV_NOPTS_VALUE;
     else
     {
-      am_private->am_pkt.avpts = 0.5 + (pts * PTS_FREQ) / DVD_TIME_BASE;\
-      if (!m_start_pts && am_private->am_pkt.avpts >= 0x7fffffff)
-        m_start_pts = am_private->am_pkt.avpts & ~0x0000ffff;
+      packet.avpts = 0.5 + (pts * PTS_FREQ) / DVD_TIME_BASE;\
+      if (!m_start_pts && packet.avpts >= 0x7fffffff)
+        m_start_pts = packet.avpts & ~0x0000ffff;
     }
-    if (am_private->am_pkt.avpts != (int64_t)AV_NOPTS_VALUE)
-      am_private->am_pkt.avpts -= m_start_pts;
+    if (packet.avpts != (int64_t)AV_NOPTS_VALUE)
+      packet.avpts -= m_start_pts;
 
 
     // handle dts, including 31bit wrap, aml can only handle 31
     // bit dts as it uses an int in kernel.
     if (dts == DVD_NOPTS_VALUE)
-      am_private->am_pkt.avdts = AV_NOPTS_VALUE;
+      packet.avdts = AV_NOPTS_VALUE;
     else
     {
-      am_private->am_pkt.avdts = 0.5 + (dts * PTS_FREQ) / DVD_TIME_BASE;
-      if (!m_start_dts && am_private->am_pkt.avdts >= 0x7fffffff)
-        m_start_dts = am_private->am_pkt.avdts & ~0x0000ffff;
+      packet.avdts = 0.5 + (dts * PTS_FREQ) / DVD_TIME_BASE;
+      if (!m_start_dts && packet.avdts >= 0x7fffffff)
+        m_start_dts = packet.avdts & ~0x0000ffff;
     }
-    if (am_private->am_pkt.avdts != (int64_t)AV_NOPTS_VALUE)
-      am_private->am_pkt.avdts -= m_start_dts;
+    if (packet.avdts != (int64_t)AV_NOPTS_VALUE)
+      packet.avdts -= m_start_dts;
+
+    QueuePts(pData, iSize, packet.avpts, pts);
+    if (pts != DVD_NOPTS_VALUE && (m_lastInputPts == DVD_NOPTS_VALUE || pts > m_lastInputPts))
+      m_lastInputPts = pts;
 
     debug_log(LOGDEBUG, "%s::%s: iSize(%d), dts(%f), pts(%f), avdts(%llx), avpts(%llx)",
-      CLASSNAME, __func__, iSize, dts, pts, am_private->am_pkt.avdts, am_private->am_pkt.avpts);
+      CLASSNAME, __func__, iSize, dts, pts, packet.avdts, packet.avpts);
 
-    while (am_private->am_pkt.isvalid)
+    // a full packet queue is the only place Decode waits, the feeder
+    // thread frees a slot each time a packet went into codec_write. a
+    // feeder waiting for a resize frees none, the resize is done here.
+    std::unique_lock<std::mutex> lock(m_queueMutex);
+    while (m_packets.size() >= PACKET_QUEUE_SIZE && !m_threadsStop)
     {
-      // abort on any errors.
-      if (write_av_packet(am_private, &am_private->am_pkt) != PLAYER_SUCCESS)
-        break;
-
-      if (am_private->am_pkt.isvalid)
-        CLog::Log(LOGDEBUG, "%s::%s: write_av_packet looping", CLASSNAME, __func__);
+      if (m_resizePending)
+      {
+        lock.unlock();
+        UpdateStreamSize();
+        lock.lock();
+      }
+      m_spaceCond.wait_for(lock, std::chrono::milliseconds(RESIZE_IDLE_TIME));
+    }
+    if (!m_freeBuffers.empty())
+    {
+      packet.data = std::move(m_freeBuffers.back());
+      m_freeBuffers.pop_back();
     }
+    lock.unlock();
 
-    // if we seek, then GetTimeSize is wrong as
-    // reports lastpts - cur_pts and hw decoder has
-    // not started outputing new pts values yet.
-    // so we grab the 1st pts sent into driver and
-    // use that to calc GetTimeSize.
-    if (m_1st_pts == 0)
-      m_1st_pts = am_private->am_pkt.lastpts;
+    packet.data.assign(pData, pData + iSize);
+
+    lock.lock();
+    m_queuedBytes += iSize;
+    m_packets.push_back(std::move(packet));
+    m_packetCond.notify_one();
+  }
+
+  // past the high watermark the caller holds back data instead of
+  // blocking in the next Decode, it can read ahead meanwhile. with
+  // nothing to hand out either, a short wait for a picture keeps the
+  // caller from spinning on empty returns.
+  bool full = IsBufferFull();
+  {
+    std::unique_lock<std::mutex> lock(m_queueMutex);
+    if (full)
+      m_readyCond.wait_for(lock, std::chrono::milliseconds(BUFFER_FULL_WAIT),
+        [this] { return !m_readyFrames.empty() || m_captureError || m_threadsStop; });
+    if (!m_readyFrames.empty())
+    {
+      m_lastFrame = m_readyFrames.front();
+      m_readyFrames.pop_front();
+    }
   }
 
-  //m_ionVideoFile->Poll(1000);
-  if (!DequeueFrame(m_lastFrame))
+  if (m_captureError)
     return VC_ERROR;
 
-  int rtn = VC_BUFFER;
+  if (m_lastFrame)
+    m_lastFrame->SetPts(GetPresentationPts(m_lastFrame->GetDecoderPts()));
+
+  int rtn = full ? 0 : VC_BUFFER;
+  if (dropped)
+    rtn |= VC_DROPPED;
 
   if (m_lastFrame)
   {
@@ -1223,15 +1981,158 @@ int CLinuxC1Codec::Decode(uint8_t *pData, size_t iSize, double dts, double pts)
     rtn |= VC_PICTURE;
   }
 
-  debug_log(LOGDEBUG, "%s::%s rtn(%d), m_cur_pictcnt(%lld), m_cur_pts(%f), lastpts(%f)",
-    CLASSNAME, __func__, rtn, m_cur_pictcnt, (float)m_cur_pts/PTS_FREQ, (float)am_private->am_pkt.lastpts/PTS_FREQ);
+  debug_log(LOGDEBUG, "%s::%s rtn(%d), m_cur_pictcnt(%lld), m_cur_pts(%f)",
+    CLASSNAME, __func__, rtn, m_cur_pictcnt, (float)m_cur_pts/PTS_FREQ);
 
   return rtn;
 }
 
+int CLinuxC1Codec::GetBufferLevel(double *duration, int *capacity)
+{
+  int bytes;
+  {
+    std::lock_guard<std::mutex> lock(m_queueMutex);
+    bytes = m_queuedBytes;
+  }
+
+  struct buf_status vbuf;
+  memzero(vbuf);
+  if (codec_get_vbuf_state(&am_private->vcodec, &vbuf) == 0)
+    bytes += vbuf.data_len;
+  if (capacity)
+    *capacity = std::max(vbuf.size, 0);
+
+  // from the last picture handed out to the latest pts written
+  if (duration)
+  {
+    *duration = -1.0;
+    if (m_lastInputPts != DVD_NOPTS_VALUE && m_lastPts != DVD_NOPTS_VALUE)
+      *duration = std::max(m_lastInputPts - m_lastPts, 0.0) / DVD_TIME_BASE;
+  }
+
+  return bytes;
+}
+
+void CLinuxC1Codec::SetBufferWatermarks(double low, double high)
+{
+  m_bufferLow = std::max(low, 0.0);
+  m_bufferHigh = std::max(high, m_bufferLow);
+}
+
+bool CLinuxC1Codec::IsBufferFull()
+{
+  double duration;
+  int capacity;
+  int bytes = GetBufferLevel(&duration, &capacity);
+  bool high, low;
+
+  if (duration >= 0.0)
+  {
+    high = duration >= m_bufferHigh;
+    low = duration < m_bufferLow;
+  }
+  else
+  {
+    // no timestamps yet, go by how full the amstream buffer is
+    if (capacity <= 0)
+      return m_bufferFull = false;
+    int fill = (int64_t)bytes * 100 / capacity;
+    high = fill >= BUFFER_FILL_HIGH;
+    low = fill < BUFFER_FILL_LOW;
+  }
+
+  if (m_bufferFull ? low : high)
+  {
+    m_bufferFull = !m_bufferFull;
+    debug_log(LOGDEBUG, "%s::%s buffer %s, %d bytes, %f s", CLASSNAME, __func__,
+      m_bufferFull ? "full" : "low", bytes, duration);
+  }
+
+  return m_bufferFull;
+}
+
+// presentation order: picture order within a sequence when both have one,
+// else the input pts, else write order
+static bool pts_entry_before(const am_pts_entry_t &a, const am_pts_entry_t &b)
+{
+  if (a.sequence >= 0 && b.sequence >= 0)
+    return a.sequence != b.sequence ? a.sequence < b.sequence : a.poc < b.poc;
+  if (a.pts != DVD_NOPTS_VALUE && b.pts != DVD_NOPTS_VALUE)
+    return a.pts < b.pts;
+  return a.order < b.order;
+}
+
+void CLinuxC1Codec::QueuePts(const uint8_t *pData, size_t size, int64_t avpts, double pts)
+{
+  am_pts_entry_t entry;
+  if (!m_picOrder.Parse(m_hints.codec, pData, size, &entry.sequence, &entry.poc))
+    return;
+  entry.order = m_ptsOrder++;
+  entry.avpts = avpts;
+  entry.pts = pts;
+
+  // a picture the decoder skipped never takes its entry. once the queue is
+  // full the earliest one is such a picture.
+  if (m_ptsQueue.size() >= PTS_QUEUE_SIZE)
+    m_ptsQueue.erase(std::min_element(m_ptsQueue.begin(), m_ptsQueue.end(), pts_entry_before));
+  m_ptsQueue.push_back(entry);
+}
+
+double CLinuxC1Codec::GetPresentationPts(int64_t decoderPts)
+{
+  double pts = DVD_NOPTS_VALUE;
+
+  if (!m_ptsQueue.empty())
+  {
+    // a pts ionvideo hands back identifies the packet, entries presented
+    // before it belong to pictures the decoder skipped. without one the
+    // picture is the next one in presentation order.
+    auto it = m_ptsQueue.end();
+    if (decoderPts > 0)
+      it = std::find_if(m_ptsQueue.begin(), m_ptsQueue.end(),
+        [decoderPts](const am_pts_entry_t &e) { return e.avpts == decoderPts; });
+    if (it == m_ptsQueue.end())
+      it = std::min_element(m_ptsQueue.begin(), m_ptsQueue.end(), pts_entry_before);
+
+    am_pts_entry_t entry = *it;
+    m_ptsQueue.erase(std::remove_if(m_ptsQueue.begin(), m_ptsQueue.end(),
+      [&entry](const am_pts_entry_t &e) { return e.order == entry.order || pts_entry_before(e, entry); }),
+      m_ptsQueue.end());
+    pts = entry.pts;
+  }
+
+  // pictures without a pts follow the last one by a frame, as do pictures
+  // with one that would go backwards
+  if (m_lastPts != DVD_NOPTS_VALUE)
+  {
+    if (pts != DVD_NOPTS_VALUE && pts > m_lastPts)
+      m_frameDuration = pts - m_lastPts;
+    else if (m_frameDuration > 0.0)
+    {
+      if (pts != DVD_NOPTS_VALUE)
+        CLog::Log(LOGDEBUG, "%s::%s pts %f not after %f", CLASSNAME, __func__, pts, m_lastPts);
+      pts = m_lastPts + m_frameDuration;
+    }
+  }
+  if (pts != DVD_NOPTS_VALUE)
+    m_lastPts = pts;
+
+  return pts;
+}
+
+void CLinuxC1Codec::SetDropState(bool bDrop)
+{
+  if (bDrop != m_dropState)
+    CLog::Log(LOGDEBUG, "%s::%s drop state %d", CLASSNAME, __func__, bDrop);
+  m_dropState = bDrop;
+}
+
 void CLinuxC1Codec::Reset() {
   CLog::Log(LOGDEBUG, "%s::%s", CLASSNAME, __func__);
 
+  // the feeder must be out of codec_write before the codec is reset
+  StopThreads();
+
   int blackout_policy;
   SysfsUtils::GetInt("/sys/class/video/blackout_policy", blackout_policy);
   SysfsUtils::SetInt("/sys/class/video/blackout_policy", 0);
@@ -1245,6 +2146,7 @@ void CLinuxC1Codec::Reset() {
 
   am_packet_release(&am_private->am_pkt);
   memzero(am_private->am_pkt);
+  am_private->last_v_duration = 0;
   am_private->am_pkt.codec = &am_private->vcodec;
   pre_header_feeding(am_private, &am_private->am_pkt);
 
@@ -1254,6 +2156,23 @@ void CLinuxC1Codec::Reset() {
   m_cur_pts = 0;
   m_cur_pictcnt = 0;
   m_old_pictcnt = 0;
+  // timestamps start over after a seek
+  m_picOrder.Reset();
+  m_ptsQueue.clear();
+  m_lastPts = DVD_NOPTS_VALUE;
+  m_lastInputPts = DVD_NOPTS_VALUE;
+  m_bufferFull = false;
   SetSpeed(m_speed);
+
+  // frames decoded before the reset are stale, give them back to ionvideo
+  std::deque<VideoFramePtr> frames;
+  {
+    std::lock_guard<std::mutex> lock(m_queueMutex);
+    frames.swap(m_readyFrames);
+  }
+  for (size_t i = 0; i < frames.size(); i++)
+    QueueFrame(frames[i]);
+
+  StartThreads();
 }
 
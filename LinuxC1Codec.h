@@ -1,10 +1,18 @@
 #pragma once
 
 #include <queue>
+#include <deque>
+#include <list>
 #include <string>
 #include <math.h>
 #include <poll.h>
 #include <memory>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #ifdef __cplusplus
 extern "C" {
@@ -54,8 +62,6 @@ typedef std::shared_ptr<VideoFrame> VideoFramePtr;
 #define EXTERNAL_PTS    (1)
 #define SYNC_OUTSIDE    (2)
 
-#define HDR_BUF_SIZE 1024
-
 #define P_PRE                     (0x02000000)
 #define PLAYER_SUCCESS            (0)
 #define PLAYER_FAILED             (-(P_PRE|0x01))
@@ -68,7 +74,35 @@ typedef std::shared_ptr<VideoFrame> VideoFramePtr;
 #define PLAYER_UNSUPPORT          (-(P_PRE|0x35))
 #define PLAYER_CHECK_CODEC_ERROR  (-(P_PRE|0x39))
 
-#define RW_WAIT_TIME    (20 * 1000) // 20ms
+#define RW_WAIT_TIME    (20)        // ms, longest wait for the stream buffer to drain
+#define RW_SPIN_TIME    (100)       // us, a writable report faster than this is suspect
+#define RW_BACKOFF_TIME (1000)      // us
+
+#define PACKET_QUEUE_SIZE   16      // demuxer packets buffered ahead of codec_write
+#define CAPTURE_POLL_TIME   50      // ms, capture thread wakeup to check for stop
+#define PTS_QUEUE_SIZE      32      // written packets waiting for their picture
+#define TRICK_FRAME_TIME    100     // ms of wall time per picture in trick play
+
+#define BUFFER_DEFAULT_LOW  0.5     // s, Decode asks for data again below this
+#define BUFFER_DEFAULT_HIGH 2.0     // s, Decode stops asking for data at this
+#define BUFFER_FILL_LOW     50      // % of the amstream buffer while the duration is unknown
+#define BUFFER_FILL_HIGH    75
+#define BUFFER_FULL_WAIT    20      // ms, Decode waits this long for a picture while full
+
+// capture frame pool sizing, see CLinuxC1Codec::GetCaptureFrameCount
+#define CAPTURE_MIN_FRAMES      3
+#define CAPTURE_MAX_FRAMES      16
+#define CAPTURE_DEFAULT_REORDER 2
+#define CAPTURE_DEFAULT_HOLD    2   // frames the renderer keeps while showing one
+#define CAPTURE_DEFAULT_BUDGET  (64 * 1024 * 1024)  // bytes of ION carveout
+
+#define CLOSE_IDLE_TIMEOUT      500 // ms, longest wait for amvdec to unload on close
+#define RESIZE_IDLE_TIME        100 // ms without a picture before the capture is resized
+#define CLOSE_IDLE_POLL         5   // ms
+
+#define ION_POOL_DEFAULT_CAP    (128 * 1024 * 1024) // bytes kept by the ION buffer pool
+
+#define ION_VIDEO_DEVICE        "/dev/video13"     // default ionvideo capture node
 
 typedef struct hdr_buf {
     char *data;
@@ -91,6 +125,25 @@ typedef struct am_packet {
     codec_para_t  *codec;
 } am_packet_t;
 
+// a demuxer packet waiting for the feeder thread, data is a copy as the
+// caller reuses its buffer as soon as Decode returns.
+typedef struct am_queued_packet {
+    std::vector<uint8_t> data;
+    int64_t              avpts;
+    int64_t              avdts;
+    int                  width;   // size of the sequence the packet starts, 0 for no change
+    int                  height;
+} am_queued_packet_t;
+
+// timestamps of a packet written to the decoder until its picture comes out
+typedef struct am_pts_entry {
+    int                  sequence;    // picture order, -1 when unknown
+    int                  poc;
+    int64_t              order;       // write order
+    int64_t              avpts;       // as checked in to the decoder
+    double               pts;
+} am_pts_entry_t;
+
 typedef enum {
     AM_STREAM_UNKNOWN = 0,
     AM_STREAM_TS,
@@ -125,6 +178,7 @@ typedef struct am_private_t
 
   pstream_type      stream_type;
   int               check_first_pts;
+  int               last_v_duration;
 
   vformat_t         video_format;
   int               video_pid;
@@ -141,6 +195,7 @@ typedef struct am_private_t
   int               h263_decodable;
   int               extrasize;
   uint8_t           *extradata;
+  hdr_buf_t         header;       // codec specific stream header, built at open
 
   int               dumpfile;
   bool              dumpdemux;
@@ -156,21 +211,70 @@ public:
   void             CloseDecoder();
   int              Decode(uint8_t *pData, size_t size, double dts, double pts);
   bool             GetPicture(DVDVideoPicture *pDvdVideoPicture);
+  // blocks up to timeout ms until decoded frames are ready, returns how many
+  // (each one is handed out by a Decode call) or -1 when capture failed.
+  int              WaitForPictures(int timeout);
   void             Reset();
   void             SetSpeed(int speed);
-  int              GetBufferLevel();
+  // bytes waiting for the decoder, queued and in the amstream buffer.
+  // duration is their estimated play time in seconds, -1 while unknown.
+  // capacity is the size of the amstream buffer, 0 while unknown.
+  int              GetBufferLevel(double *duration = NULL, int *capacity = NULL);
+  // Decode stops returning VC_BUFFER once the buffered duration reaches high
+  // and returns it again below low. small values suit live streams.
+  void             SetBufferWatermarks(double low, double high);
   void             SetDropState(bool bDrop);
+  // highest hevc temporal sub-layer, the dropped sub-layer non-reference
+  // pictures have to be in it. -1 (default) while unknown keeps them all.
+  void             SetMaxTemporalId(int id) { m_maxTemporalId = id; }
+  // before OpenDecoder, false makes codec_write block in the kernel. the
+  // default non-blocking mode waits for writability with a bounded timeout
+  // so the feeder thread can always be stopped.
+  void             SetNonBlocking(bool noblock) { m_noblock = noblock; }
+  // inputs of the capture frame pool size. any time after OpenDecoder a
+  // change renegotiates the pool with VIDIOC_REQBUFS, the codec stays open.
+  bool             SetReorderDepth(int frames);
+  bool             SetConsumerHold(int frames);
+  bool             SetCaptureBudget(size_t bytes);
+  int              GetCaptureFrames() const { return m_videoFrames.size(); }
+  // before OpenDecoder, V4L2_PIX_FMT_RGB32 (default), NV12 or NV21
+  bool             SetCaptureFormat(uint32_t format);
+  // before OpenDecoder, ionvideo scales pictures larger than this box down
+  // to fit it, keeping their aspect. 0x0 captures at the decoded size.
+  void             SetOutputSize(int width, int height) { m_outputWidth = width; m_outputHeight = height; }
+  // before OpenDecoder, the ionvideo node this session captures from. each
+  // concurrent session needs its own node, ION_VIDEO_DEVICE by default.
+  void             SetDevice(const std::string &device) { m_device = device; }
+  // ION buffers stay allocated between sessions up to this many bytes
+  static void      SetIonPoolCap(size_t bytes);
 
 private:
   double           GetPlayerPtsSeconds();
 
   bool          OpenIonVideo(const CDVDStreamInfo &hints);
+  void          GetCaptureSize(const CDVDStreamInfo &hints, int *width, int *height) const;
+  int           GetCaptureFrameCount() const;
+  bool          RequestFrames(int count);
+  bool          ReconfigureCapture();
+  bool          SetCaptureSize(const CDVDStreamInfo &hints);
+  void          SetScalingRate(const CDVDStreamInfo &hints);
+  bool          UpdateStreamSize();
+  void          QueuePts(const uint8_t *pData, size_t size, int64_t avpts, double pts);
+  double        GetPresentationPts(int64_t decoderPts);
+  bool          IsBufferFull();
   bool          QueueFrame(VideoFramePtr frame);
   bool          DequeueFrame(VideoFramePtr &frame);
   bool          StartStreaming();
   bool          StopStreaming();
   void          CloseIonVideo();
 
+  void          StartThreads();
+  void          StopThreads();
+  void          StartCapture();
+  void          StopCapture();
+  void          FeederThread();
+  void          CaptureThread();
+
   volatile int     m_speed;
   CDVDStreamInfo   m_hints;
   am_private_t    *am_private;
@@ -181,9 +285,59 @@ private:
   int64_t          m_start_dts;
   int64_t          m_start_pts;
 
-  PosixFilePtr               m_ionFile;
+  std::string                m_device;
   PosixFilePtr               m_ionVideoFile;
+  bool                       m_sysfsAcquired;
   std::vector<VideoFramePtr> m_videoFrames;
   VideoFramePtr              m_lastFrame;
   bool                       m_dropState;
+  int                        m_maxTemporalId;
+  bool                       m_noblock;
+  uint32_t                   m_captureFormat;
+  int                        m_outputWidth;
+  int                        m_outputHeight;
+  int                        m_captureWidth;
+  int                        m_captureHeight;
+  int                        m_reorderDepth;
+  int                        m_consumerHold;
+  size_t                     m_captureBudget;
+
+  // pictures come out in presentation order, input timestamps in decode
+  // order. Decode matches them up with the picture order of the packets.
+  CPicOrderParser            m_picOrder;
+  std::deque<am_pts_entry_t> m_ptsQueue;
+  int64_t                    m_ptsOrder;
+  double                     m_lastPts;
+  double                     m_frameDuration;
+  double                     m_lastInputPts;    // latest pts written
+  double                     m_bufferLow;
+  double                     m_bufferHigh;
+  bool                       m_bufferFull;
+
+  // Decode queues packets for the feeder thread, which owns am_pkt and
+  // codec_write while running. the capture thread dequeues decoded frames
+  // into m_readyFrames for Decode to hand out. queues are under m_queueMutex.
+  std::thread                     m_feederThread;
+  std::thread                     m_captureThread;
+  std::atomic<bool>               m_threadsStop;
+  std::atomic<bool>               m_captureStop;
+  std::atomic<bool>               m_captureError;
+  std::mutex                      m_queueMutex;
+  std::condition_variable         m_packetCond;
+  std::condition_variable         m_spaceCond;
+  std::condition_variable         m_frameCond;
+  std::condition_variable         m_readyCond;
+  std::deque<am_queued_packet_t>  m_packets;
+  std::vector<std::vector<uint8_t>> m_freeBuffers;
+  int                             m_queuedBytes;    // data in m_packets
+  std::deque<VideoFramePtr>       m_readyFrames;
+  int                             m_driverFrames;   // frames queued to ionvideo
+  int64_t                         m_lastCaptureTime;
+
+  // a packet that starts a sequence of another size holds the feeder back
+  // until the capture side is resized. the decoder session stays open.
+  int                             m_streamWidth;    // size of the last queued sequence
+  int                             m_streamHeight;
+  bool                            m_resizePending;  // the feeder waits at m_packets.front()
+  int64_t                         m_resizeTime;
 };
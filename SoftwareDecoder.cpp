@@ -0,0 +1,292 @@
+#include "system.h"
+
+#ifndef THIS_IS_NOT_XBMC
+  #include "DVDClock.h"
+  #include "utils/log.h"
+#endif
+
+#include "SoftwareDecoder.h"
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+#include "libavutil/mem.h"
+}
+
+#include <math.h>
+
+#ifdef CLASSNAME
+#undef CLASSNAME
+#endif
+#define CLASSNAME "CSoftwareDecoder"
+
+static int64_t to_av_time(double time)
+{
+  return time == DVD_NOPTS_VALUE ? AV_NOPTS_VALUE : llrint(time);
+}
+
+CSoftwareDecoder::CSoftwareDecoder() :
+  m_context(NULL),
+  m_pending(NULL),
+  m_next(0),
+  m_ready(false),
+  m_draining(false),
+  m_frameDuration(0.0),
+  m_name("c1-sw")
+{
+  for (int i = 0; i < SW_FRAME_POOL; i++)
+    m_frames[i] = NULL;
+}
+
+CSoftwareDecoder::~CSoftwareDecoder()
+{
+  Close();
+}
+
+bool CSoftwareDecoder::Open(const CDVDStreamInfo &hints)
+{
+  Close();
+
+  AVCodec *codec = avcodec_find_decoder(hints.codec);
+  if (!codec)
+  {
+    CLog::Log(LOGERROR, "%s::%s - no software decoder for codec id %d", CLASSNAME, __func__, hints.codec);
+    return false;
+  }
+
+  m_context = avcodec_alloc_context3(codec);
+  if (!m_context)
+    return false;
+
+  m_context->codec_tag = hints.codec_tag;
+  m_context->coded_width = hints.width;
+  m_context->coded_height = hints.height;
+  m_context->pkt_timebase = av_make_q(1, DVD_TIME_BASE);
+  if (hints.extradata && hints.extrasize > 0)
+  {
+    m_context->extradata = (uint8_t*)av_mallocz(hints.extrasize + FF_INPUT_BUFFER_PADDING_SIZE);
+    if (m_context->extradata)
+    {
+      m_context->extradata_size = hints.extrasize;
+      memcpy(m_context->extradata, hints.extradata, hints.extrasize);
+    }
+  }
+
+  // frame threads keep every core busy on inter coded streams, slice
+  // threads help the intra only and single slice streams frame threads
+  // can not split. libavcodec picks what the codec supports.
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  m_context->thread_count = cores < 1 ? 1 : (cores > SW_MAX_THREADS ? SW_MAX_THREADS : (int)cores);
+  m_context->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+  if (avcodec_open2(m_context, codec, NULL) < 0)
+  {
+    CLog::Log(LOGERROR, "%s::%s - avcodec_open2() failed for %s", CLASSNAME, __func__, codec->name);
+    Close();
+    return false;
+  }
+
+  // the pool frames are reused for the whole stream, the decoder recycles
+  // their buffers through its own buffer pool once they are unreferenced
+  for (int i = 0; i < SW_FRAME_POOL; i++)
+  {
+    m_frames[i] = av_frame_alloc();
+    if (!m_frames[i])
+    {
+      Close();
+      return false;
+    }
+  }
+  m_pending = av_packet_alloc();
+  if (!m_pending)
+  {
+    Close();
+    return false;
+  }
+
+  if (hints.fpsrate > 0 && hints.fpsscale > 0)
+    m_frameDuration = (double)DVD_TIME_BASE * hints.fpsscale / hints.fpsrate;
+  m_name = std::string("c1-sw-") + codec->name;
+
+  CLog::Log(LOGDEBUG, "%s::%s - %s with %d threads", CLASSNAME, __func__, codec->name, m_context->thread_count);
+  return true;
+}
+
+void CSoftwareDecoder::Close()
+{
+  for (int i = 0; i < SW_FRAME_POOL; i++)
+    av_frame_free(&m_frames[i]);
+  av_packet_free(&m_pending);
+  if (m_context)
+    avcodec_free_context(&m_context);
+  m_next = 0;
+  m_ready = false;
+  m_draining = false;
+  m_frameDuration = 0.0;
+}
+
+int CSoftwareDecoder::Decode(uint8_t *pData, int iSize, double dts, double pts)
+{
+  if (!m_context)
+    return VC_ERROR;
+
+  // a packet the full output turned away goes in before anything new,
+  // the caller sends no new packet until VC_BUFFER comes back
+  if (m_pending->size > 0)
+  {
+    int ret = SendPacket(m_pending);
+    if (ret == AVERROR(EAGAIN))
+      return m_ready ? VC_PICTURE : 0;
+    av_packet_unref(m_pending);
+    if (ret < 0)
+      return VC_ERROR;
+    if (m_draining)
+      avcodec_send_packet(m_context, NULL);
+  }
+
+  if (pData)
+  {
+    // a drained decoder takes no more input until it is flushed
+    if (m_draining)
+      Reset();
+
+    AVPacket pkt;
+    av_init_packet(&pkt);
+    pkt.data = pData;
+    pkt.size = iSize;
+    pkt.pts = to_av_time(pts);
+    pkt.dts = to_av_time(dts);
+
+    int ret = SendPacket(&pkt);
+    // the picture not handed out yet blocks the output, the packet waits
+    // in a copy of its own until the next call
+    if (ret == AVERROR(EAGAIN) && av_packet_ref(m_pending, &pkt) < 0)
+      return VC_ERROR;
+    if (ret < 0 && ret != AVERROR(EAGAIN))
+      return VC_ERROR;
+  }
+
+  if (!m_ready)
+    ReceiveFrame();
+
+  return (m_ready ? VC_PICTURE : 0) | (m_pending->size > 0 ? 0 : VC_BUFFER);
+}
+
+int CSoftwareDecoder::SendPacket(AVPacket *pkt)
+{
+  int ret = avcodec_send_packet(m_context, pkt);
+  // the output is full, take the pending picture and hand the packet in again
+  if (ret == AVERROR(EAGAIN) && !m_ready && ReceiveFrame())
+    ret = avcodec_send_packet(m_context, pkt);
+  // broken packets are skipped, the decoder resyncs at the next one
+  if (ret == AVERROR_INVALIDDATA)
+    ret = 0;
+  if (ret < 0 && ret != AVERROR(EAGAIN))
+    CLog::Log(LOGERROR, "%s::%s - avcodec_send_packet() failed: %d", CLASSNAME, __func__, ret);
+  return ret;
+}
+
+void CSoftwareDecoder::Drain()
+{
+  if (!m_context || m_draining)
+    return;
+  m_draining = true;
+  // a packet still waiting goes in first, Decode sends the end after it
+  if (m_pending->size == 0)
+    avcodec_send_packet(m_context, NULL);
+}
+
+bool CSoftwareDecoder::ReceiveFrame()
+{
+  AVFrame *frame = m_frames[m_next];
+  av_frame_unref(frame);
+  m_ready = avcodec_receive_frame(m_context, frame) == 0;
+  return m_ready;
+}
+
+void CSoftwareDecoder::Reset()
+{
+  if (m_context)
+    avcodec_flush_buffers(m_context);
+  for (int i = 0; i < SW_FRAME_POOL; i++)
+    if (m_frames[i])
+      av_frame_unref(m_frames[i]);
+  if (m_pending)
+    av_packet_unref(m_pending);
+  m_ready = false;
+  m_draining = false;
+}
+
+bool CSoftwareDecoder::GetPicture(DVDVideoPicture *pDvdVideoPicture)
+{
+  if (!m_ready)
+    return false;
+
+  AVFrame *frame = m_frames[m_next];
+  m_next = (m_next + 1) % SW_FRAME_POOL;
+  m_ready = false;
+
+  ERenderFormat format;
+  switch (frame->format)
+  {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+      format = RENDER_FMT_YUV420P;
+      break;
+    case AV_PIX_FMT_YUV420P10:
+      format = RENDER_FMT_YUV420P10;
+      break;
+    case AV_PIX_FMT_NV12:
+      format = RENDER_FMT_NV12;
+      break;
+    default:
+      CLog::Log(LOGERROR, "%s::%s - unsupported pixel format %d", CLASSNAME, __func__, frame->format);
+      return false;
+  }
+
+  memzero(*pDvdVideoPicture);
+  for (int i = 0; i < 3; i++)
+  {
+    pDvdVideoPicture->data[i] = frame->data[i];
+    pDvdVideoPicture->iLineSize[i] = frame->linesize[i];
+  }
+  pDvdVideoPicture->format          = format;
+  pDvdVideoPicture->iFlags          = DVP_FLAG_ALLOCATED;
+  if (frame->interlaced_frame)
+    pDvdVideoPicture->iFlags       |= DVP_FLAG_INTERLACED;
+  if (frame->top_field_first)
+    pDvdVideoPicture->iFlags       |= DVP_FLAG_TOP_FIELD_FIRST;
+  pDvdVideoPicture->iWidth          = frame->width;
+  pDvdVideoPicture->iHeight         = frame->height;
+  pDvdVideoPicture->iDisplayWidth   = frame->width;
+  pDvdVideoPicture->iDisplayHeight  = frame->height;
+  if (frame->sample_aspect_ratio.num > 0 && frame->sample_aspect_ratio.den > 0)
+    pDvdVideoPicture->iDisplayWidth = ((int)lrint((double)frame->width * av_q2d(frame->sample_aspect_ratio))) & -3;
+  pDvdVideoPicture->color_range     = frame->color_range == AVCOL_RANGE_JPEG || frame->format == AV_PIX_FMT_YUVJ420P;
+  pDvdVideoPicture->color_matrix    = frame->colorspace;
+  pDvdVideoPicture->color_primaries = frame->color_primaries;
+  pDvdVideoPicture->color_transfer  = frame->color_trc;
+  pDvdVideoPicture->chroma_position = frame->chroma_location;
+  pDvdVideoPicture->iFrameType      = frame->pict_type <= AV_PICTURE_TYPE_B ? frame->pict_type : 0;
+  pDvdVideoPicture->iRepeatPicture  = 0.5 * frame->repeat_pict;
+  pDvdVideoPicture->iDuration       = m_frameDuration;
+  pDvdVideoPicture->dts             = DVD_NOPTS_VALUE;
+  pDvdVideoPicture->pts             = frame->best_effort_timestamp != AV_NOPTS_VALUE ?
+                                      (double)frame->best_effort_timestamp : DVD_NOPTS_VALUE;
+  return true;
+}
+
+void CSoftwareDecoder::SetDropState(bool bDrop)
+{
+  // non reference pictures are skipped before they are decoded
+  if (m_context)
+    m_context->skip_frame = bDrop ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+}
+
+int CSoftwareDecoder::WaitForPictures(int timeout)
+{
+  // decoding is synchronous, a picture is either ready now or only comes
+  // with more input, or after Drain at the end of the stream
+  if (!m_context)
+    return -1;
+  return m_ready || ReceiveFrame() ? 1 : 0;
+}
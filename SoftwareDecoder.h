@@ -0,0 +1,56 @@
+#pragma once
+
+#ifndef THIS_IS_NOT_XBMC
+  #include "DVDVideoCodec.h"
+  #include "DVDStreamInfo.h"
+#else
+  #include "xbmcstubs.h"
+#endif
+
+#include <string>
+
+struct AVCodecContext;
+struct AVFrame;
+struct AVPacket;
+
+// libavcodec threads, one per online core up to this many
+#define SW_MAX_THREADS      16
+// frames in flight: the one handed out by GetPicture and the one being
+// received, the picture stays valid until the next GetPicture
+#define SW_FRAME_POOL       2
+
+// libavcodec decoder behind the CDVDVideoCodecC1 interface, used for the
+// streams the C1 hardware can not take. pictures point into the decoded
+// frame planes as RENDER_FMT_YUV420P, RENDER_FMT_YUV420P10 or RENDER_FMT_NV12.
+class CSoftwareDecoder
+{
+public:
+  CSoftwareDecoder();
+  ~CSoftwareDecoder();
+
+  bool        Open(const CDVDStreamInfo &hints);
+  void        Close();
+  int         Decode(uint8_t *pData, int iSize, double dts, double pts);
+  void        Reset();
+  bool        GetPicture(DVDVideoPicture *pDvdVideoPicture);
+  void        SetDropState(bool bDrop);
+  // 1 when a picture is ready for Decode to hand out, else 0
+  int         WaitForPictures(int timeout);
+  // the caller has no more input, the frames the threads still hold come
+  // out of the following Decode calls until the next Reset
+  void        Drain();
+  const char* GetName() const { return m_name.c_str(); }
+
+private:
+  bool        ReceiveFrame();
+  int         SendPacket(AVPacket *pkt);
+
+  AVCodecContext *m_context;
+  AVPacket       *m_pending;     // packet the full output turned away, sent by the next Decode
+  AVFrame        *m_frames[SW_FRAME_POOL];
+  int             m_next;        // pool slot the next frame is received into
+  bool            m_ready;       // m_frames[m_next] holds a picture not handed out yet
+  bool            m_draining;
+  double          m_frameDuration;
+  std::string     m_name;
+};
@@ -0,0 +1,675 @@
+#include "system.h"
+
+#include "BitstreamConverter.h"
+
+#include <vector>
+#include <algorithm>
+
+#ifdef CLASSNAME
+#undef CLASSNAME
+#endif
+#define CLASSNAME "Bench"
+
+/************************** allocation counting ****************************/
+
+// glibc entry points, used to count heap traffic of the code under test.
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void  __libc_free(void *ptr);
+}
+
+static volatile uint64_t g_allocs = 0;
+
+extern "C" void *malloc(size_t size)
+{
+  g_allocs++;
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t nmemb, size_t size)
+{
+  g_allocs++;
+  return __libc_calloc(nmemb, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+  g_allocs++;
+  return __libc_realloc(ptr, size);
+}
+
+extern "C" void *memalign(size_t alignment, size_t size)
+{
+  g_allocs++;
+  return __libc_memalign(alignment, size);
+}
+
+extern "C" int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  g_allocs++;
+  void *ptr = __libc_memalign(alignment, size);
+  if (!ptr)
+    return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+extern "C" void free(void *ptr)
+{
+  __libc_free(ptr);
+}
+
+// the parsers log every nal at LOGDEBUG, keep stdout out of the timings
+void CLog::Log(int loglevel, const char *format, ... )
+{
+  if (loglevel < LOGNOTICE)
+    return;
+
+  va_list argptr;
+  va_start(argptr, format);
+  vfprintf(stdout, format, argptr);
+  fprintf(stdout, "\n");
+  va_end(argptr);
+}
+
+// exposes the protected annexb parser
+class CBenchConverter : public CBitstreamConverter
+{
+public:
+  using CBitstreamConverter::avc_parse_nal_units;
+};
+
+/************************** synthetic streams ****************************/
+
+// 1920x1080 High profile, frame_mbs_only, no vui
+static const uint8_t avc_sps[] = {
+  0x67, 0x64, 0x00, 0x28, 0xac, 0xd9, 0x40, 0x78, 0x02, 0x27, 0xe5, 0xc0,
+  0x44, 0x00, 0x00, 0x03, 0x00, 0x04, 0x00, 0x00, 0x03, 0x00, 0xc8, 0x3c,
+  0x60, 0xc6, 0x58
+};
+static const uint8_t avc_pps[] = {
+  0x68, 0xeb, 0xe3, 0xcb, 0x22, 0xc0
+};
+
+// 1920x1080 Main profile
+static const uint8_t hevc_vps[] = {
+  0x40, 0x01, 0x0c, 0x01, 0xff, 0xff, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00,
+  0x90, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x5d, 0x95, 0x98, 0x09
+};
+static const uint8_t hevc_sps[] = {
+  0x42, 0x01, 0x01, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00, 0x90, 0x00, 0x00,
+  0x03, 0x00, 0x00, 0x03, 0x00, 0x5d, 0xa0, 0x03, 0xc0, 0x80, 0x10, 0xe5,
+  0x96, 0x56, 0x69, 0x24, 0xca, 0xe0, 0x10, 0x00, 0x00, 0x03, 0x00, 0x10,
+  0x00, 0x00, 0x03, 0x01, 0xe0, 0x80
+};
+static const uint8_t hevc_pps[] = {
+  0x44, 0x01, 0xc1, 0x72, 0xb4, 0x62, 0x40
+};
+
+// 720x576 25 fps 4:3 sequence header, gop header and picture header
+static const uint8_t mpeg2_seq[] = {
+  0x00, 0x00, 0x01, 0xb3, 0x2d, 0x02, 0x40, 0x23, 0x1e, 0x84, 0xd0, 0xa0,
+  0x00, 0x00, 0x01, 0xb8, 0x00, 0x08, 0x00, 0x40
+};
+static const uint8_t mpeg2_pic[] = {
+  0x00, 0x00, 0x01, 0x00, 0x00, 0x0f, 0xff, 0xf8
+};
+
+typedef std::vector<uint8_t> ByteVector;
+
+// length_size 0 is an annexb stream, 4 byte start code for the first nal
+// of a packet and 3 byte ones after it, like x264 writes them. packets are
+// stored with BS_STARTCODE_PADDING zero bytes behind them like demuxer
+// packets, the start code scanners may read that far.
+struct BenchStream
+{
+  std::string             name;
+  AVCodecID               codec;
+  int                     length_size;
+  ByteVector              extradata;
+  std::vector<ByteVector> packets;
+};
+
+static void add_packet(BenchStream &stream, const uint8_t *begin, const uint8_t *end)
+{
+  ByteVector packet(begin, end);
+  packet.resize(packet.size() + BS_STARTCODE_PADDING, 0);
+  stream.packets.push_back(packet);
+}
+
+static size_t packet_size(const ByteVector &packet)
+{
+  return packet.size() - BS_STARTCODE_PADDING;
+}
+
+static uint32_t bench_rand(uint32_t *seed)
+{
+  *seed = *seed * 1103515245 + 12345;
+  return *seed >> 8;
+}
+
+static void put_be(ByteVector &out, uint32_t value, int bytes)
+{
+  while (bytes--)
+    out.push_back((value >> (bytes * 8)) & 0xff);
+}
+
+static void put_nal(ByteVector &out, const uint8_t *header, int header_size, int size,
+  int length_size, uint32_t *seed)
+{
+  if (length_size)
+    put_be(out, size, length_size);
+  else
+    put_be(out, 1, out.empty() ? 4 : 3);
+  out.insert(out.end(), header, header + header_size);
+  // payload never contains zero bytes so it can not emulate a start code
+  for (int i = header_size; i < size; i++)
+    out.push_back((bench_rand(seed) % 255) + 1);
+}
+
+static void make_avcc(ByteVector &out, int length_size)
+{
+  if (!length_size)
+  {
+    put_be(out, 1, 4);
+    out.insert(out.end(), avc_sps, avc_sps + sizeof(avc_sps));
+    put_be(out, 1, 4);
+    out.insert(out.end(), avc_pps, avc_pps + sizeof(avc_pps));
+    return;
+  }
+
+  out.push_back(1);
+  out.push_back(avc_sps[1]);
+  out.push_back(avc_sps[2]);
+  out.push_back(avc_sps[3]);
+  out.push_back(0xfc | (length_size - 1));
+  out.push_back(0xe1);
+  put_be(out, sizeof(avc_sps), 2);
+  out.insert(out.end(), avc_sps, avc_sps + sizeof(avc_sps));
+  out.push_back(1);
+  put_be(out, sizeof(avc_pps), 2);
+  out.insert(out.end(), avc_pps, avc_pps + sizeof(avc_pps));
+}
+
+static void make_hvcc(ByteVector &out)
+{
+  static const uint8_t *units[] = { hevc_vps, hevc_sps, hevc_pps };
+  static const int unit_sizes[] = { sizeof(hevc_vps), sizeof(hevc_sps), sizeof(hevc_pps) };
+
+  out.push_back(1);               // configurationVersion
+  out.push_back(0x01);            // general_profile_space/tier/profile_idc
+  put_be(out, 0x60000000, 4);     // general_profile_compatibility_flags
+  put_be(out, 0x900000, 3);       // general_constraint_indicator_flags
+  put_be(out, 0x000000, 3);
+  out.push_back(0x5d);            // general_level_idc
+  put_be(out, 0xf000, 2);         // min_spatial_segmentation_idc
+  out.push_back(0xfc);            // parallelismType
+  out.push_back(0xfd);            // chroma_format_idc
+  out.push_back(0xf8);            // bit_depth_luma_minus8
+  out.push_back(0xf8);            // bit_depth_chroma_minus8
+  put_be(out, 0, 2);              // avgFrameRate
+  out.push_back(0x0f);            // numTemporalLayers, lengthSizeMinusOne
+  out.push_back(3);               // numOfArrays
+  for (int i = 0; i < 3; i++)
+  {
+    out.push_back((units[i][0] >> 1) & 0x3f);
+    put_be(out, 1, 2);
+    put_be(out, unit_sizes[i], 2);
+    out.insert(out.end(), units[i], units[i] + unit_sizes[i]);
+  }
+}
+
+static void make_stream(BenchStream &stream, const char *name, AVCodecID codec, int length_size,
+  int frames, int gop, int slices, int idr_size, int slice_size)
+{
+  uint32_t seed = 0x1234;
+
+  stream.name = name;
+  stream.codec = codec;
+  stream.length_size = length_size;
+  stream.extradata.clear();
+  stream.packets.clear();
+
+  if (codec == AV_CODEC_ID_H264)
+    make_avcc(stream.extradata, length_size);
+  else
+    make_hvcc(stream.extradata);
+
+  for (int frame = 0; frame < frames; frame++)
+  {
+    ByteVector packet;
+    bool idr = (frame % gop) == 0;
+    uint8_t header[2];
+    int header_size;
+
+    if (codec == AV_CODEC_ID_H264)
+    {
+      header[0] = idr ? 0x65 : 0x41;
+      header_size = 1;
+    }
+    else
+    {
+      header[0] = (idr ? 19 : 1) << 1;
+      header[1] = 0x01;
+      header_size = 2;
+    }
+
+    for (int slice = 0; slice < slices; slice++)
+    {
+      int size = idr ? idr_size : slice_size;
+      size += bench_rand(&seed) % (size / 4 + 1);
+      put_nal(packet, header, header_size, size, length_size, &seed);
+    }
+    add_packet(stream, packet.data(), packet.data() + packet.size());
+  }
+}
+
+static void make_mpeg2_stream(BenchStream &stream, int frames, int gop, int slices, int slice_size)
+{
+  uint32_t seed = 0x5678;
+
+  stream.name = "mpeg2 sd";
+  stream.codec = AV_CODEC_ID_MPEG2VIDEO;
+  stream.length_size = 0;
+  stream.extradata.clear();
+  stream.packets.clear();
+
+  for (int frame = 0; frame < frames; frame++)
+  {
+    ByteVector packet;
+
+    if ((frame % gop) == 0)
+      packet.insert(packet.end(), mpeg2_seq, mpeg2_seq + sizeof(mpeg2_seq));
+    packet.insert(packet.end(), mpeg2_pic, mpeg2_pic + sizeof(mpeg2_pic));
+    for (int slice = 1; slice <= slices; slice++)
+    {
+      put_be(packet, 0x100 | slice, 4);
+      int size = slice_size + bench_rand(&seed) % (slice_size / 4 + 1);
+      for (int i = 0; i < size; i++)
+        packet.push_back((bench_rand(&seed) % 255) + 1);
+    }
+    add_packet(stream, packet.data(), packet.data() + packet.size());
+  }
+}
+
+/************************** recorded streams ****************************/
+
+// splits a raw h264 annexb elementary stream into access units. a new
+// access unit starts at an aud, sps, pps, sei or at a slice whose
+// first_mb_in_slice is 0, parameter sets before the first slice also
+// become the extradata.
+static bool load_annexb(BenchStream &stream, const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return false;
+
+  ByteVector data;
+  uint8_t chunk[64 * 1024];
+  size_t got;
+  while ((got = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    data.insert(data.end(), chunk, chunk + got);
+  fclose(file);
+  size_t size = data.size();
+  data.resize(size + BS_STARTCODE_PADDING, 0);
+
+  stream.name = path;
+  stream.codec = AV_CODEC_ID_H264;
+  stream.length_size = 0;
+  stream.extradata.clear();
+  stream.packets.clear();
+
+  const uint8_t *begin = data.data();
+  const uint8_t *end = begin + size;
+  const uint8_t *nal = CBitstreamParser::FindStartCode(begin, end);
+  if (nal > begin && nal < end && !nal[-1])
+    nal--;
+  const uint8_t *au = nal;
+  bool slices = false, first_slice = true;
+
+  while (nal < end)
+  {
+    const uint8_t *payload = nal;
+    while (payload < end && !*payload)
+      payload++;
+    payload++;
+    if (payload >= end)
+      break;
+    const uint8_t *next = CBitstreamParser::FindStartCode(payload, end);
+    // a start code found after a zero byte belongs to the 4 byte form
+    if (next < end && next > payload && !next[-1])
+      next--;
+
+    int type = *payload & 0x1f;
+    bool vcl = type >= 1 && type <= 5;
+    bool starts_au = (vcl && payload + 1 < end && (payload[1] & 0x80)) ||
+      (type >= 6 && type <= 9);
+
+    if (starts_au && slices)
+    {
+      add_packet(stream, au, nal);
+      au = nal;
+      slices = false;
+    }
+    if ((type == 7 || type == 8) && first_slice)
+      stream.extradata.insert(stream.extradata.end(), nal, next);
+    if (vcl)
+    {
+      slices = true;
+      first_slice = false;
+    }
+    nal = next;
+  }
+  if (slices)
+    add_packet(stream, au, end);
+
+  return !stream.packets.empty() && !stream.extradata.empty();
+}
+
+/************************** benchmarks ****************************/
+
+static double elapsed_ns(const timespec &start, const timespec &end)
+{
+  return (double)(end.tv_sec - start.tv_sec) * 1000000000.0 + (double)(end.tv_nsec - start.tv_nsec);
+}
+
+static void print_result(const BenchStream &stream, uint64_t bytes, uint64_t packets,
+  double ns, uint64_t allocs, const char *extra)
+{
+  printf("%-24s %10.1f MB/s %10.1f ns/packet %8.3f allocs/packet%s\n", stream.name.c_str(),
+    (double)bytes / ns * 1000.0, ns / packets, (double)allocs / packets, extra);
+}
+
+static void bench_convert(const BenchStream &stream, int loops, bool zerocopy)
+{
+  CBitstreamConverter converter;
+  ByteVector extradata = stream.extradata;
+  ByteVector packet;
+
+  extradata.resize(stream.extradata.size() + BS_STARTCODE_PADDING, 0);
+
+  // 4 byte nal sizes go to annexb, 3 byte ones to 4 byte and annexb to avcC
+  bool to_annexb = stream.length_size == 4;
+  if (!converter.Open(stream.codec, extradata.data(), stream.extradata.size(), to_annexb))
+  {
+    printf("%-24s open failed\n", stream.name.c_str());
+    return;
+  }
+  converter.SetZeroCopy(zerocopy);
+
+  // zero copy rewrites the packet, every Convert gets a fresh copy of the
+  // demuxer packet and only the Convert call itself is timed.
+  packet.reserve(4 * 1024 * 1024);
+
+  // warm up, the first packets are allowed to size the convert buffer
+  for (size_t i = 0; i < stream.packets.size(); i++)
+  {
+    packet.assign(stream.packets[i].begin(), stream.packets[i].end());
+    converter.Convert(packet.data(), packet_size(packet));
+  }
+
+  uint64_t bytes = 0, packets = 0, inplace = 0;
+  uint64_t allocs = 0;
+  double ns = 0;
+  timespec startTs, endTs;
+
+  for (int loop = 0; loop < loops; loop++)
+  {
+    for (size_t i = 0; i < stream.packets.size(); i++)
+    {
+      packet.assign(stream.packets[i].begin(), stream.packets[i].end());
+
+      uint64_t count = g_allocs;
+      clock_gettime(CLOCK_MONOTONIC, &startTs);
+      converter.Convert(packet.data(), packet_size(packet));
+      clock_gettime(CLOCK_MONOTONIC, &endTs);
+      allocs += g_allocs - count;
+
+      ns += elapsed_ns(startTs, endTs);
+      bytes += packet_size(packet);
+      packets++;
+      if (converter.GetConvertBuffer() == packet.data())
+        inplace++;
+    }
+  }
+
+  char extra[32];
+  snprintf(extra, sizeof(extra), " %5.1f%% in place", 100.0 * inplace / packets);
+  print_result(stream, bytes, packets, ns, allocs, extra);
+}
+
+static void bench_parse_nal_units(const BenchStream &stream, int loops)
+{
+  ByteVector out;
+  uint64_t bytes = 0, packets = 0, allocs = 0;
+  double ns = 0;
+  timespec startTs, endTs;
+
+  out.resize(4 * 1024 * 1024);
+
+  // the same sizing and writing pass Convert does for annexb input
+  for (int loop = 0; loop < loops; loop++)
+  {
+    for (size_t i = 0; i < stream.packets.size(); i++)
+    {
+      const ByteVector &packet = stream.packets[i];
+      byte_writer_t bw;
+
+      uint64_t count = g_allocs;
+      clock_gettime(CLOCK_MONOTONIC, &startTs);
+      int size = CBenchConverter::avc_parse_nal_units(NULL, packet.data(), packet_size(packet));
+      if ((size_t)size > out.size())
+        out.resize(size);
+      bw.buf = bw.buf_ptr = out.data();
+      bw.size = 0;
+      CBenchConverter::avc_parse_nal_units(&bw, packet.data(), packet_size(packet));
+      clock_gettime(CLOCK_MONOTONIC, &endTs);
+      allocs += g_allocs - count;
+
+      ns += elapsed_ns(startTs, endTs);
+      bytes += packet_size(packet);
+      packets++;
+    }
+  }
+
+  print_result(stream, bytes, packets, ns, allocs, "");
+}
+
+static void bench_find_idr(const BenchStream &stream, int loops)
+{
+  uint64_t bytes = 0, packets = 0, allocs = 0, idr = 0;
+  double ns = 0;
+  timespec startTs, endTs;
+
+  for (int loop = 0; loop < loops; loop++)
+  {
+    for (size_t i = 0; i < stream.packets.size(); i++)
+    {
+      const ByteVector &packet = stream.packets[i];
+
+      uint64_t count = g_allocs;
+      clock_gettime(CLOCK_MONOTONIC, &startTs);
+      bool found = CBitstreamParser::FindIdrSlice(packet.data(), packet_size(packet));
+      clock_gettime(CLOCK_MONOTONIC, &endTs);
+      allocs += g_allocs - count;
+
+      ns += elapsed_ns(startTs, endTs);
+      bytes += packet_size(packet);
+      packets++;
+      idr += found;
+    }
+  }
+
+  char extra[32];
+  snprintf(extra, sizeof(extra), " %8d idr", (int)(idr / loops));
+  print_result(stream, bytes, packets, ns, allocs, extra);
+}
+
+static void bench_mpeg2_header(const BenchStream &stream, int loops)
+{
+  uint64_t bytes = 0, packets = 0, allocs = 0, changed = 0;
+  double ns = 0;
+  timespec startTs, endTs;
+
+  for (int loop = 0; loop < loops; loop++)
+  {
+    mpeg2_sequence sequence;
+    memzero(sequence);
+
+    for (size_t i = 0; i < stream.packets.size(); i++)
+    {
+      const ByteVector &packet = stream.packets[i];
+
+      uint64_t count = g_allocs;
+      clock_gettime(CLOCK_MONOTONIC, &startTs);
+      changed += CBitstreamConverter::mpeg2_sequence_header(packet.data(), packet_size(packet), &sequence);
+      clock_gettime(CLOCK_MONOTONIC, &endTs);
+      allocs += g_allocs - count;
+
+      ns += elapsed_ns(startTs, endTs);
+      bytes += packet_size(packet);
+      packets++;
+    }
+  }
+
+  char extra[32];
+  snprintf(extra, sizeof(extra), " %8d changes", (int)(changed / loops));
+  print_result(stream, bytes, packets, ns, allocs, extra);
+}
+
+static void bench_startcode(int loops)
+{
+  // 16 MB of slice data with a start code every 4-64 KB, random payload
+  // keeps the natural 1/256 density of zero bytes.
+  const int size = 16 * 1024 * 1024;
+  ByteVector buffer(size + BS_STARTCODE_PADDING, 0);
+  uint32_t seed = 0x4321;
+  int pos = 0;
+
+  while (pos < size)
+  {
+    int nal_size = 4096 + bench_rand(&seed) % (60 * 1024);
+    if (pos + 4 <= size)
+    {
+      buffer[pos + 2] = 1;
+      pos += 4;
+    }
+    for (int i = 0; i < nal_size && pos < size; i++, pos++)
+    {
+      uint8_t value = bench_rand(&seed);
+      // emulation prevention, never let 00 00 0x (x < 3) appear
+      if (value <= 2 && pos >= 2 && !buffer[pos - 1] && !buffer[pos - 2])
+        value = 3;
+      buffer[pos] = value;
+    }
+  }
+
+  int count;
+  const bs_startcode_kernel *kernels = CBitstreamParser::GetStartCodeKernels(&count);
+  const uint8_t *end = buffer.data() + size;
+  int reference = -1;
+
+  for (int k = 0; k < count; k++)
+  {
+    int found = 0;
+    timespec startTs, endTs;
+
+    clock_gettime(CLOCK_MONOTONIC, &startTs);
+    for (int loop = 0; loop < loops; loop++)
+    {
+      found = 0;
+      const uint8_t *p = kernels[k].find(buffer.data(), end);
+      while (p < end)
+      {
+        found++;
+        p = kernels[k].find(p + 3, end);
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &endTs);
+
+    if (reference < 0)
+      reference = found;
+
+    double ns = elapsed_ns(startTs, endTs);
+    printf("%-24s %10.2f GB/s %10d start codes%s\n", kernels[k].name,
+      (double)size * loops / ns, found, found != reference ? " MISMATCH" : "");
+  }
+}
+
+static void bench_parse_sps(int loops)
+{
+  bool interlaced = true;
+  int32_t max_ref_frames = 0;
+  int count = loops * 100000;
+  timespec startTs, endTs;
+
+  // avc_sps carries two emulation prevention bytes, skip the nal header
+  clock_gettime(CLOCK_MONOTONIC, &startTs);
+  for (int i = 0; i < count; i++)
+    CBitstreamConverter::parseh264_sps(avc_sps + 1, sizeof(avc_sps) - 1, &interlaced, &max_ref_frames);
+  clock_gettime(CLOCK_MONOTONIC, &endTs);
+
+  printf("%-24s %10.1f ns/sps     interlaced %d, max_ref_frames %d\n", "h264 sps",
+    elapsed_ns(startTs, endTs) / count, interlaced, max_ref_frames);
+}
+
+// usage: bench [loops] [annexb.h264 ...], recorded raw h264 elementary
+// streams are run through the annexb paths next to the synthetic corpus.
+int main(int argc, char** argv)
+{
+  int loops = 20;
+
+  if (argc > 1)
+    loops = atoi(argv[1]);
+  loops = std::max(loops, 1);
+
+  std::vector<BenchStream> corpus(5);
+  make_stream(corpus[0], "h264 small slices", AV_CODEC_ID_H264, 4, 600, 60, 8, 16 * 1024, 1500);
+  make_stream(corpus[1], "h264 large idr", AV_CODEC_ID_H264, 4, 300, 30, 1, 512 * 1024, 40 * 1024);
+  make_stream(corpus[2], "h264 3 byte nal", AV_CODEC_ID_H264, 3, 300, 30, 4, 64 * 1024, 8 * 1024);
+  make_stream(corpus[3], "h264 annexb", AV_CODEC_ID_H264, 0, 600, 60, 8, 16 * 1024, 1500);
+  make_stream(corpus[4], "hevc 4k many slices", AV_CODEC_ID_HEVC, 4, 300, 60, 32, 32 * 1024, 4 * 1024);
+
+  for (int i = 2; i < argc; i++)
+  {
+    BenchStream stream;
+    if (load_annexb(stream, argv[i]))
+      corpus.push_back(stream);
+    else
+      printf("%s: not a h264 annexb stream, skipped\n", argv[i]);
+  }
+
+  BenchStream mpeg2;
+  make_mpeg2_stream(mpeg2, 500, 12, 36, 2 * 1024);
+
+  for (int zerocopy = 0; zerocopy < 2; zerocopy++)
+  {
+    printf("== Convert (%s)\n", zerocopy ? "zero copy" : "copy");
+    for (size_t i = 0; i < corpus.size(); i++)
+      bench_convert(corpus[i], loops, zerocopy);
+  }
+
+  printf("== avc_parse_nal_units\n");
+  for (size_t i = 0; i < corpus.size(); i++)
+    if (!corpus[i].length_size)
+      bench_parse_nal_units(corpus[i], loops);
+
+  printf("== FindIdrSlice\n");
+  for (size_t i = 0; i < corpus.size(); i++)
+    if (!corpus[i].length_size)
+      bench_find_idr(corpus[i], loops);
+
+  printf("== mpeg2_sequence_header\n");
+  bench_mpeg2_header(mpeg2, loops);
+
+  printf("== FindStartCode kernels\n");
+  bench_startcode(loops);
+
+  printf("== parseh264_sps\n");
+  bench_parse_sps(loops);
+
+  return 0;
+}
@@ -0,0 +1,149 @@
+#include "system.h"
+
+#include "DVDVideoCodecC1.h"
+
+extern "C" {
+#include "libavformat/avformat.h"
+}
+
+#include <string.h>
+
+#ifdef CLASSNAME
+#undef CLASSNAME
+#endif
+#define CLASSNAME "BenchReopen"
+
+// closes and reopens the hardware decoder on the same stream and reports
+// how long close, open and the first decoded frame take. needs the
+// amlogic decoder, unlike bench which only runs the software paths.
+
+static double elapsed_ms(const timespec &start, const timespec &end)
+{
+  return (double)(end.tv_sec - start.tv_sec) * 1000.0 + (double)(end.tv_nsec - start.tv_nsec) / 1000000.0;
+}
+
+static double ToDvdTime(int64_t ts, AVRational time_base)
+{
+  if (ts == (int64_t)AV_NOPTS_VALUE)
+    return DVD_NOPTS_VALUE;
+  return (double)ts * time_base.num * DVD_TIME_BASE / time_base.den;
+}
+
+int main(int argc, char** argv)
+{
+  AVFormatContext *formatCtx = NULL;
+  AVPacket packet;
+  int videoStream = -1;
+  int cycles = 10;
+
+  if (argc < 2)
+  {
+    fprintf(stderr, "usage: %s <media> [cycles]\n", argv[0]);
+    return 1;
+  }
+  if (argc > 2)
+    cycles = atoi(argv[2]);
+
+  av_register_all();
+
+  if (avformat_open_input(&formatCtx, argv[1], NULL, NULL) != 0 ||
+      avformat_find_stream_info(formatCtx, NULL) < 0)
+  {
+    CLog::Log(LOGERROR, "%s::%s - unable to open: %s", CLASSNAME, __func__, argv[1]);
+    return 1;
+  }
+
+  for (unsigned int i = 0; i < formatCtx->nb_streams; ++i)
+    if (formatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+      videoStream = i;
+      break;
+    }
+  if (videoStream == -1) {
+    CLog::Log(LOGERROR, "%s::%s - Unable to find video stream in the file.", CLASSNAME, __func__);
+    return 1;
+  }
+
+  AVCodecParameters *codecParameters = formatCtx->streams[videoStream]->codecpar;
+  AVRational timeBase = formatCtx->streams[videoStream]->time_base;
+  CDVDVideoCodecC1 *codec = new CDVDVideoCodecC1();
+  CDVDCodecOptions options;
+  DVDVideoPicture picture;
+  double open_ms = 0, first_ms = 0, close_ms = 0;
+  int done = 0;
+
+  for (int cycle = 0; cycle < cycles; cycle++)
+  {
+    CDVDStreamInfo hints;
+    timespec openTs, openedTs, firstTs, closedTs;
+
+    memzero(hints);
+    hints.codec     = codecParameters->codec_id;
+    hints.codec_tag = codecParameters->codec_tag;
+    hints.width     = codecParameters->width;
+    hints.height    = codecParameters->height;
+    // Open takes ownership of the extradata, padded like the demuxer's
+    hints.extrasize = codecParameters->extradata_size;
+    hints.extradata = calloc(1, hints.extrasize + BS_STARTCODE_PADDING);
+    memcpy(hints.extradata, codecParameters->extradata, hints.extrasize);
+
+    av_seek_frame(formatCtx, videoStream, 0, AVSEEK_FLAG_BACKWARD);
+
+    clock_gettime(CLOCK_MONOTONIC, &openTs);
+    if (!codec->Open(hints, options))
+    {
+      CLog::Log(LOGERROR, "%s::%s - open failed in cycle %d", CLASSNAME, __func__, cycle);
+      break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &openedTs);
+    // a busy or rejecting decoder falls back to libavcodec, that is no reopen
+    if (strncmp(codec->GetName(), "c1-sw", 5) == 0)
+    {
+      CLog::Log(LOGERROR, "%s::%s - %s instead of the hardware in cycle %d", CLASSNAME, __func__, codec->GetName(), cycle);
+      codec->Dispose();
+      break;
+    }
+
+    int ret = 0;
+    bool picture_ready = false;
+    av_init_packet(&packet);
+    while (!picture_ready && !(ret & VC_ERROR) && av_read_frame(formatCtx, &packet) >= 0)
+    {
+      if (packet.stream_index == videoStream)
+      {
+        ret = codec->Decode(packet.data, packet.size,
+          ToDvdTime(packet.dts, timeBase), ToDvdTime(packet.pts, timeBase));
+        picture_ready = (ret & VC_PICTURE) != 0;
+      }
+      av_packet_unref(&packet);
+    }
+    if (!picture_ready && !(ret & VC_ERROR) && codec->WaitForPictures(1000) > 0)
+      picture_ready = (codec->Decode(NULL, 0, DVD_NOPTS_VALUE, DVD_NOPTS_VALUE) & VC_PICTURE) != 0;
+    if (picture_ready)
+      codec->GetPicture(&picture);
+    clock_gettime(CLOCK_MONOTONIC, &firstTs);
+
+    codec->Dispose();
+    clock_gettime(CLOCK_MONOTONIC, &closedTs);
+
+    if (!picture_ready)
+    {
+      CLog::Log(LOGERROR, "%s::%s - no picture in cycle %d", CLASSNAME, __func__, cycle);
+      break;
+    }
+
+    printf("cycle %3d: open %8.2f ms, first frame %8.2f ms, close %8.2f ms\n", cycle,
+      elapsed_ms(openTs, openedTs), elapsed_ms(openedTs, firstTs), elapsed_ms(firstTs, closedTs));
+    open_ms += elapsed_ms(openTs, openedTs);
+    first_ms += elapsed_ms(openedTs, firstTs);
+    close_ms += elapsed_ms(firstTs, closedTs);
+    done++;
+  }
+
+  if (done)
+    printf("average of %d: open %.2f ms, first frame %.2f ms, close %.2f ms, close to first frame %.2f ms\n",
+      done, open_ms / done, first_ms / done, close_ms / done, (close_ms + open_ms + first_ms) / done);
+
+  delete codec;
+  avformat_close_input(&formatCtx);
+  return done == cycles ? 0 : 1;
+}
@@ -1,5 +1,8 @@
 #include "system.h"
 #include "main.h"
+#include "KeyframeIndex.h"
+
+#include <map>
 
 #include "egl.h"
 #include <GLES2/gl2.h>
@@ -17,21 +20,23 @@
 #endif
 #define CLASSNAME "Main"
 
-void Cleanup() {
-  if (m_cVideoCodec)
-    delete m_cVideoCodec;
-  if (m_cHints)
-    delete m_cHints;
-  if (m_pDvdVideoPicture)
-    delete m_pDvdVideoPicture;
-
-  avcodec_close(codecCtx);
-  av_free(codecCtx);
-  avformat_close_input(&formatCtx);
+void Cleanup(DecodeSession &session) {
+  delete session.videoCodec;
+  delete session.hints;
+  delete session.picture;
+
+  avcodec_close(session.codecCtx);
+  av_free(session.codecCtx);
+  avformat_close_input(&session.formatCtx);
+  memzero(session);
 }
 
+// the one session SIGINT cleans up
+static DecodeSession *activeSession = NULL;
+
 void intHandler(int dummy=0) {
-  Cleanup();
+  if (activeSession)
+    Cleanup(*activeSession);
   exit(0);
 }
 
@@ -79,6 +84,23 @@ void main()\n \
 \n \
 ";
 
+// NV12/NV21 pictures are imported as one external image, the driver
+// converts to RGB while sampling
+const char* fragmentSourceExternal = "\n \
+#extension GL_OES_EGL_image_external : require\n \
+uniform lowp samplerExternalOES DiffuseMap;\n \
+\n \
+varying mediump vec2 TexCoord0;\n \
+\n \
+void main()\n \
+{\n \
+  mediump vec4 rgba = texture2D(DiffuseMap, TexCoord0);\n \
+\n \
+  gl_FragColor = rgba;\n \
+}\n \
+\n \
+";
+
 const float quad[] =
 {
   -1,  1, 0,
@@ -103,6 +125,7 @@ const float quadUV[] =
 
 EGLDisplay display;
 EGLSurface surface;
+uint32_t captureFormat = V4L2_PIX_FMT_RGB32;
 
 
 void initGL()
@@ -131,7 +154,7 @@ void initGL()
     else
     {
       shaderType = GL_FRAGMENT_SHADER;
-      sourceCode = fragmentSource;
+      sourceCode = captureFormat == V4L2_PIX_FMT_RGB32 ? fragmentSource : fragmentSourceExternal;
     }
 
     GLuint openGLShaderID = glCreateShader(shaderType);
@@ -232,46 +255,64 @@ void initGL()
 
 void EnableTexture(DVDVideoPicture *picture)
 {
-  static GLuint textures[8]={0,0,0,0,0,0,0,0};
+  // keyed by dma-buf fd, the decoder may resize its frame pool at any time
+  static std::map<long, GLuint> textures;
+  long key = reinterpret_cast<long>(picture->data[0]);
 
-  if(!textures[picture->iIndex])
+  // NV12/NV21 fourccs are the same in V4L2 and DRM
+  bool planar = picture->extended_format != V4L2_PIX_FMT_RGB32;
+  GLenum target = planar ? GL_TEXTURE_EXTERNAL_OES : GL_TEXTURE_2D;
+
+  if(!textures[key])
   {
     EGLint img_attrs[] = {
       EGL_WIDTH, (EGLint)picture->iWidth,
       EGL_HEIGHT, (EGLint)picture->iHeight,
-      EGL_LINUX_DRM_FOURCC_EXT, DRM_FORMAT_RGBA8888,
+      EGL_LINUX_DRM_FOURCC_EXT, planar ? (EGLint)picture->extended_format : DRM_FORMAT_RGBA8888,
       EGL_DMA_BUF_PLANE0_FD_EXT, (EGLint)reinterpret_cast<long>(picture->data[0]),
-      EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
+      EGL_DMA_BUF_PLANE0_OFFSET_EXT, (EGLint)reinterpret_cast<long>(picture->data[2]),
       EGL_DMA_BUF_PLANE0_PITCH_EXT, picture->iLineSize[0],
+      EGL_NONE, EGL_NONE,
+      EGL_NONE, EGL_NONE,
+      EGL_NONE, EGL_NONE,
       EGL_NONE
     };
+    if (planar)
+    {
+      img_attrs[12] = EGL_DMA_BUF_PLANE1_FD_EXT;
+      img_attrs[13] = (EGLint)reinterpret_cast<long>(picture->data[1]);
+      img_attrs[14] = EGL_DMA_BUF_PLANE1_OFFSET_EXT;
+      img_attrs[15] = (EGLint)reinterpret_cast<long>(picture->data[3]);
+      img_attrs[16] = EGL_DMA_BUF_PLANE1_PITCH_EXT;
+      img_attrs[17] = picture->iLineSize[1];
+    }
 
     EGLImageKHR image = eglCreateImageKHR(display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, 0, img_attrs);
     GL_CheckError();
 
-    glGenTextures(1, &textures[picture->iIndex]);
+    glGenTextures(1, &textures[key]);
     GL_CheckError();
 
     glActiveTexture(GL_TEXTURE0);
     GL_CheckError();
 
-    glBindTexture(GL_TEXTURE_2D, textures[picture->iIndex]);
+    glBindTexture(target, textures[key]);
     GL_CheckError();
 
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameterf(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     GL_CheckError();
 
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameterf(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     GL_CheckError();
 
-    glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
+    glEGLImageTargetTexture2DOES(target, image);
     GL_CheckError();
   }
   // Upload texture data
   glActiveTexture(GL_TEXTURE0);
   GL_CheckError();
 
-  glBindTexture(GL_TEXTURE_2D, textures[picture->iIndex]);
+  glBindTexture(target, textures[key]);
   GL_CheckError();
 
   // Set the quad vertex data
@@ -295,41 +336,115 @@ void EnableTexture(DVDVideoPicture *picture)
 
 /************************** EGL ****************************/
 
+static double ToDvdTime(int64_t ts, AVRational time_base)
+{
+  if (ts == (int64_t)AV_NOPTS_VALUE)
+    return DVD_NOPTS_VALUE;
+  return (double)ts * time_base.num * DVD_TIME_BASE / time_base.den;
+}
+
+// trick play demuxes only random access points of the index, one per
+// TRICK_FRAME_TIME at the requested speed. the gop bodies are never read.
+static bool ReadTrickPacket(DecodeSession &session, int videoStream, const CKeyframeIndex &index,
+  double speed, size_t *next, AVPacket *packet)
+{
+  const kf_index_entry *entry = index.GetEntry(*next);
+  if (!entry)
+    return false;
+
+  int num, den;
+  index.GetTimeBase(&num, &den);
+  int64_t stride = (int64_t)(fabs(speed) * TRICK_FRAME_TIME / 1000 * den / num);
+
+  // entries ascend in pts, step to the first one a stride away
+  size_t count = index.GetCount();
+  size_t i = *next;
+  if (speed > 0)
+  {
+    while (i < count && index.GetEntry(i)->pts < entry->pts + stride)
+      i++;
+  }
+  else
+  {
+    while (i < count && index.GetEntry(i)->pts > entry->pts - stride)
+      i = i ? i - 1 : count;
+  }
+  *next = i;
+
+  av_seek_frame(session.formatCtx, videoStream, entry->offset, AVSEEK_FLAG_BYTE);
+  while (av_read_frame(session.formatCtx, packet) >= 0)
+  {
+    if (packet->stream_index == videoStream)
+      return true;
+    av_packet_unref(packet);
+  }
+  return false;
+}
+
+// trick play pictures are shown TRICK_FRAME_TIME apart, the stride between
+// them makes that the requested speed
+static void PaceTrickPicture(timespec *last)
+{
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t elapsed = (int64_t)(now.tv_sec - last->tv_sec) * 1000000 + (now.tv_nsec - last->tv_nsec) / 1000;
+  if (last->tv_sec && elapsed < TRICK_FRAME_TIME * 1000)
+    usleep(TRICK_FRAME_TIME * 1000 - elapsed);
+  clock_gettime(CLOCK_MONOTONIC, last);
+}
+
 int main(int argc, char** argv) {
-  m_cVideoCodec = NULL;
-  m_cHints = NULL;
-  m_pDvdVideoPicture = NULL;
-  formatCtx = NULL;
-  codecCtx = NULL;
-  codecParameters = NULL;
-  codec = NULL;
+  DecodeSession session;
+  AVCodecParameters* codecParameters = NULL;
+  AVCodec* codec = NULL;
   AVPacket packet;
   int videoStream = -1;
   const char* vidPath;
+  double startTime = 0.0;
+  const char* device = ION_VIDEO_DEVICE;
+  double speed = 1.0;
+  CKeyframeIndex index;
+  size_t trickEntry = 0;
+  timespec trickTs = { 0, 0 };
   timespec startTs, endTs;
 
+  memzero(session);
+  activeSession = &session;
   signal(SIGINT, intHandler);
 
   if (argc > 1)
     vidPath = (char *)argv[1];
   else
     vidPath = (char *)"video";
+  if (argc > 2)
+    startTime = atof(argv[2]);
+  if (argc > 3)
+  {
+    if (!strcmp(argv[3], "nv12"))
+      captureFormat = V4L2_PIX_FMT_NV12;
+    else if (!strcmp(argv[3], "nv21"))
+      captureFormat = V4L2_PIX_FMT_NV21;
+  }
+  if (argc > 4)
+    device = argv[4];
+  if (argc > 5 && atof(argv[5]) != 0.0)
+    speed = atof(argv[5]);
 
   av_register_all();
 
-  if (avformat_open_input(&formatCtx, vidPath, NULL, NULL) != 0) {
+  if (avformat_open_input(&session.formatCtx, vidPath, NULL, NULL) != 0) {
     CLog::Log(LOGERROR, "%s::%s - avformat_open_input() unable to open: %s", CLASSNAME, __func__, vidPath);
     return false;
   }
   CLog::Log(LOGDEBUG, "%s::%s - video file: %s", CLASSNAME, __func__, vidPath);
 
-  if (avformat_find_stream_info(formatCtx, NULL) < 0) {
+  if (avformat_find_stream_info(session.formatCtx, NULL) < 0) {
     CLog::Log(LOGERROR, "%s::%s - avformat_find_stream_info() failed.", CLASSNAME, __func__);
     return false;
   }
 
-  for (unsigned int i = 0; i < formatCtx->nb_streams; ++i)
-    if (formatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+  for (unsigned int i = 0; i < session.formatCtx->nb_streams; ++i)
+    if (session.formatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
       videoStream = i;
       break;
     }
@@ -340,40 +455,69 @@ int main(int argc, char** argv) {
   }
   CLog::Log(LOGDEBUG, "%s::%s - Video stream in the file is stream number %d", CLASSNAME, __func__, videoStream);
 
-  codecParameters = formatCtx->streams[videoStream]->codecpar;
+  codecParameters = session.formatCtx->streams[videoStream]->codecpar;
   codec = avcodec_find_decoder(codecParameters->codec_id);
-  codecCtx = avcodec_alloc_context3(codec);
+  session.codecCtx = avcodec_alloc_context3(codec);
   if (codec == NULL) {
     CLog::Log(LOGERROR, "%s::%s - Unsupported codec.", CLASSNAME, __func__);
     return false;
   }
-  if (avcodec_open2(codecCtx, codec, NULL) < 0) {
+  if (avcodec_open2(session.codecCtx, codec, NULL) < 0) {
     CLog::Log(LOGERROR, "%s::%s - Unable to open codec.", CLASSNAME, __func__);
     return false;
   }
   CLog::Log(LOGDEBUG, "%s::%s - AVCodec: %s, id %d", CLASSNAME, __func__, codec->name, codec->id);
 
-  m_cVideoCodec = new CDVDVideoCodecC1();
+  session.videoCodec = new CDVDVideoCodecC1();
+  session.videoCodec->SetCaptureFormat(captureFormat);
+  session.videoCodec->SetDevice(device);
 
-  m_cHints = new CDVDStreamInfo();
-  m_cHints->software = false;
-  m_cHints->extradata = codecParameters->extradata;
-  m_cHints->extrasize = codecParameters->extradata_size;
-  m_cHints->codec     = codecParameters->codec_id;
-  m_cHints->codec_tag = codecParameters->codec_tag;
-  m_cHints->width     = codecParameters->width;
-  m_cHints->height    = codecParameters->height;
+  session.hints = new CDVDStreamInfo();
+  session.hints->software = false;
+  session.hints->extradata = codecParameters->extradata;
+  session.hints->extrasize = codecParameters->extradata_size;
+  session.hints->codec     = codecParameters->codec_id;
+  session.hints->codec_tag = codecParameters->codec_tag;
+  session.hints->width     = codecParameters->width;
+  session.hints->height    = codecParameters->height;
 
-  CLog::Log(LOGDEBUG, "%s::%s - Header of size %d", CLASSNAME, __func__, codecCtx->extradata_size);
+  CLog::Log(LOGDEBUG, "%s::%s - Header of size %d", CLASSNAME, __func__, session.codecCtx->extradata_size);
 
   CDVDCodecOptions options;
 
-  if (!m_cVideoCodec->Open(*m_cHints, options)) {
-    Cleanup();
+  if (!session.videoCodec->Open(*session.hints, options)) {
+    Cleanup(session);
     return false;
   }
 
 
+  bool indexed = index.Open(vidPath) && index.GetCount() > 0;
+  if (speed != 1.0) {
+    session.videoCodec->SetSpeed((int)(speed * DVD_PLAYSPEED_NORMAL));
+    if (speed < 0)
+      trickEntry = index.GetCount() - 1;
+  }
+
+  if (startTime > 0.0) {
+    // the keyframe index gives the byte offset of the random access point
+    // directly, without it the demuxer has to search by timestamp
+    if (indexed) {
+      int num, den;
+      index.GetTimeBase(&num, &den);
+      int64_t pts = (int64_t)(startTime * den / num);
+      const kf_index_entry *entry = index.FindKeyframe(pts);
+      trickEntry = entry - index.GetEntry(0);
+      CLog::Log(LOGDEBUG, "%s::%s - Seeking to keyframe at offset %lld, pts %lld", CLASSNAME, __func__,
+        (long long)entry->offset, (long long)entry->pts);
+      av_seek_frame(session.formatCtx, videoStream, entry->offset, AVSEEK_FLAG_BYTE);
+    }
+    else {
+      AVStream *stream = session.formatCtx->streams[videoStream];
+      int64_t pts = (int64_t)(startTime * stream->time_base.den / stream->time_base.num);
+      av_seek_frame(session.formatCtx, videoStream, pts, AVSEEK_FLAG_BACKWARD);
+    }
+  }
+
   CLog::Log(LOGNOTICE, "%s::%s - ===START===", CLASSNAME, __func__);
 
   initGL();
@@ -382,13 +526,16 @@ int main(int argc, char** argv) {
 
   int frameNumber = 0;
   int ret = 0;
-  m_pDvdVideoPicture = new DVDVideoPicture();
+  session.picture = new DVDVideoPicture();
 
   clock_gettime(CLOCK_REALTIME, &startTs);
 
   av_init_packet(&packet);
 
-  while (av_read_frame(formatCtx, &packet) >= 0) {
+  AVRational timeBase = session.formatCtx->streams[videoStream]->time_base;
+  bool trick = speed != 1.0 && indexed;
+  while (trick ? ReadTrickPacket(session, videoStream, index, speed, &trickEntry, &packet)
+               : av_read_frame(session.formatCtx, &packet) >= 0) {
 
     if (packet.stream_index != videoStream)
       continue;
@@ -401,15 +548,37 @@ int main(int argc, char** argv) {
 
     CLog::Log(LOGDEBUG, "%s::%s - Extracted frame number %d of size %d", CLASSNAME, __func__, frameNumber, packet.size);
 
-    ret = m_cVideoCodec->Decode(packet.data, packet.size, packet.pts, packet.dts);
-    if (ret & VC_PICTURE)
+    // Decode paces the loop, it only waits while the decoder input is full.
+    // every picture ready by then is taken before the next packet.
+    ret = session.videoCodec->Decode(packet.data, packet.size,
+      ToDvdTime(packet.dts, timeBase), ToDvdTime(packet.pts, timeBase));
+    for (;;)
     {
-      m_cVideoCodec->GetPicture(m_pDvdVideoPicture);
-      //EnableTexture(m_pDvdVideoPicture);
+      while (ret & VC_PICTURE)
+      {
+        session.videoCodec->GetPicture(session.picture);
+        if (speed != 1.0)
+          PaceTrickPicture(&trickTs);
+        //EnableTexture(session.picture);
+        ret = session.videoCodec->Decode(NULL, 0, DVD_NOPTS_VALUE, DVD_NOPTS_VALUE);
+      }
+      // no VC_BUFFER, the decoder is above its high watermark. pictures
+      // have to come out before the next packet goes in.
+      if ((ret & (VC_BUFFER | VC_ERROR)) || session.videoCodec->WaitForPictures(1000) <= 0)
+        break;
+      ret = session.videoCodec->Decode(NULL, 0, DVD_NOPTS_VALUE, DVD_NOPTS_VALUE);
     }
 
     av_packet_unref(&packet);
-    usleep(1000*10);
+  }
+
+  // drain, the decoder is done once no picture shows up for a second
+  session.videoCodec->SetEndOfStream();
+  while (ret >= 0 && !(ret & VC_ERROR) && session.videoCodec->WaitForPictures(1000) > 0)
+  {
+    ret = session.videoCodec->Decode(NULL, 0, DVD_NOPTS_VALUE, DVD_NOPTS_VALUE);
+    if (ret & VC_PICTURE)
+      session.videoCodec->GetPicture(session.picture);
   }
 
   CLog::Log(LOGNOTICE, "%s::%s - ===STOP===", CLASSNAME, __func__);
@@ -419,6 +588,6 @@ int main(int argc, char** argv) {
   double fps = (double)frameNumber / seconds;
   CLog::Log(LOGNOTICE, "%s::%s - Runtime %f sec, fps: %f", CLASSNAME, __func__, seconds, fps);
 
-  Cleanup();
+  Cleanup(session);
   return 0;
 }
@@ -2,10 +2,17 @@
 
 #include "DVDVideoCodecC1.h"
 
-CDVDVideoCodecC1* m_cVideoCodec;
-DVDVideoPicture* m_pDvdVideoPicture;
-CDVDStreamInfo* m_cHints;
-AVFormatContext* formatCtx;
-AVCodecContext* codecCtx;
-AVCodecParameters* codecParameters;
-AVCodec* codec;
+extern "C" {
+#include "libavformat/avformat.h"
+}
+
+// everything one decode owns. sessions share nothing, several can run
+// side by side in one process.
+struct DecodeSession
+{
+  CDVDVideoCodecC1* videoCodec;
+  DVDVideoPicture*  picture;
+  CDVDStreamInfo*   hints;
+  AVFormatContext*  formatCtx;
+  AVCodecContext*   codecCtx;
+};
@@ -0,0 +1,58 @@
+#include "system.h"
+
+#include "KeyframeIndex.h"
+
+extern "C" {
+#include "libavformat/avformat.h"
+}
+
+#ifdef CLASSNAME
+#undef CLASSNAME
+#endif
+#define CLASSNAME "MfcIndex"
+
+// writes <media>.mfcidx next to each media file given on the command line
+int main(int argc, char** argv)
+{
+  int failed = 0;
+
+  if (argc < 2)
+  {
+    fprintf(stderr, "usage: %s <media> [media...]\n", argv[0]);
+    return 1;
+  }
+
+  av_register_all();
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string mediaPath = argv[i];
+    std::string indexPath = CKeyframeIndex::GetIndexPath(mediaPath);
+    timespec startTs, endTs;
+
+    clock_gettime(CLOCK_MONOTONIC, &startTs);
+    if (!CKeyframeIndex::Build(mediaPath, indexPath))
+    {
+      fprintf(stderr, "%s: indexing failed\n", mediaPath.c_str());
+      failed++;
+      continue;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &endTs);
+
+    CKeyframeIndex index;
+    if (!index.Open(mediaPath))
+    {
+      fprintf(stderr, "%s: cannot open %s\n", mediaPath.c_str(), indexPath.c_str());
+      failed++;
+      continue;
+    }
+
+    struct stat st;
+    double seconds = (double)(endTs.tv_sec - startTs.tv_sec) + (double)(endTs.tv_nsec - startTs.tv_nsec) / 1000000000;
+    double mbytes = stat(mediaPath.c_str(), &st) == 0 ? (double)st.st_size / (1024 * 1024) : 0.0;
+    printf("%s: %d random access points, %.1f MB in %.2f sec (%.1f MB/s)\n", indexPath.c_str(),
+      (int)index.GetCount(), mbytes, seconds, seconds > 0.0 ? mbytes / seconds : 0.0);
+  }
+
+  return failed ? 1 : 0;
+}
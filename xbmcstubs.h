@@ -167,6 +167,21 @@ public:
 
     return ret;
   }
+  static int GetString(const std::string& path, std::string& valstr)
+  {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return -1;
+
+    char buf[256];
+    ssize_t len;
+    valstr.clear();
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+      valstr.append(buf, len);
+    close(fd);
+
+    return len < 0 ? -1 : 0;
+  }
   static int SetString(const std::string& path, const std::string& valstr)
   {
     int fd = open(path.c_str(), O_RDWR, 0644);